@@ -0,0 +1,86 @@
+// loads a large .env file line by line through environment::operator[], and in bulk through
+// transaction::load_dotenv
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+#include "red/sessions/session.hpp"
+
+using clock_type = std::chrono::steady_clock;
+using red::session::environment;
+
+namespace {
+
+constexpr int lines = 5000;
+constexpr int rounds = 5;
+
+std::string key(int i) {
+    return "DOTENV_BENCH_" + std::to_string(i);
+}
+
+// what we did before, a getline and a setenv per line
+void load_line_by_line(std::filesystem::path const& path)
+{
+    environment env;
+    std::ifstream in{path};
+    std::string line;
+    while (std::getline(in, line))
+    {
+        auto const eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == std::string::npos)
+            continue;
+        env[line.substr(0, eq)] = std::string_view(line).substr(eq + 1);
+    }
+}
+
+void load_in_bulk(std::filesystem::path const& path)
+{
+    environment::transaction{}.load_dotenv(path).commit();
+}
+
+void cleanup()
+{
+    environment::transaction transaction;
+    for (int i = 0; i < lines; i++)
+        transaction.erase(key(i));
+    transaction.commit();
+}
+
+template<class Fn>
+double bench(std::filesystem::path const& path, Fn&& load)
+{
+    clock_type::duration total{};
+    for (int r = 0; r < rounds; r++)
+    {
+        auto const start = clock_type::now();
+        load(path);
+        total += clock_type::now() - start;
+
+        if (environment{}[key(lines - 1)].value() != "value number " + std::to_string(lines - 1))
+            std::puts("the last variable is missing");
+        cleanup();
+    }
+    return std::chrono::duration<double, std::milli>(total).count() / rounds;
+}
+
+} // unnamed namespace
+
+int main()
+{
+    auto const path = std::filesystem::temp_directory_path() / "red-sessions-bench.env";
+    {
+        std::ofstream out{path, std::ios::binary | std::ios::trunc};
+        out << "# generated\n";
+        for (int i = 0; i < lines; i++)
+            out << key(i) << "=value number " << i << '\n';
+    }
+
+    std::printf("%d lines, ms per load\n", lines);
+    std::printf("%-14s %10.2f\n", "line by line", bench(path, load_line_by_line));
+    std::printf("%-14s %10.2f\n", "bulk", bench(path, load_in_bulk));
+
+    std::filesystem::remove(path);
+}
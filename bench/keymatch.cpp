@@ -0,0 +1,117 @@
+// compares the library's key matcher with the envstr_finder it replaced, on a large block
+#include <chrono>
+#include <cstdio>
+#include <locale>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "key_matcher.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::size_t entries = 20000;
+constexpr int rounds = 20;
+
+// the old case insensitive traits, toupper with the classic locale for every char
+struct ci_char_traits : public std::char_traits<char> {
+    static int compare(const char_type* s1, const char_type* s2, size_t n) {
+        auto& LC = std::locale::classic();
+        while (n-- != 0) {
+            if (toupper(*s1, LC) < toupper(*s2, LC)) return -1;
+            if (toupper(*s1, LC) > toupper(*s2, LC)) return 1;
+            ++s1; ++s2;
+        }
+        return 0;
+    }
+};
+
+// the old matcher, measures every entry before comparing
+template<typename Traits>
+struct envstr_finder
+{
+    using StrView = std::basic_string_view<char, Traits>;
+    StrView key;
+
+    bool operator() (StrView entry) const noexcept
+    {
+        return
+            entry.length() > key.length() &&
+            entry[key.length()] == '=' &&
+            entry.compare(0, key.length(), key) == 0;
+    }
+};
+
+template<typename Traits>
+char** find_scalar(char** block, std::string_view key)
+{
+    envstr_finder<Traits> const matches{{key.data(), key.size()}};
+    for (; *block; block++) {
+        if (matches(*block))
+            return block;
+    }
+    return nullptr;
+}
+
+// the library's matcher over the same block
+char** find_entry(char** block, std::string_view key, bool ignore_case)
+{
+    red::session::detail::basic_key_matcher<char> const matches(key, ignore_case);
+    for (; *block; block++) {
+        if (matches(*block))
+            return block;
+    }
+    return nullptr;
+}
+
+template<class Fn>
+double bench(std::vector<std::string> const& keys, Fn&& find)
+{
+    std::size_t found = 0;
+    auto const start = clock_type::now();
+    for (int r = 0; r < rounds; r++) {
+        for (auto& key : keys)
+            found += find(key) != nullptr;
+    }
+    auto const elapsed = clock_type::now() - start;
+
+    if (found != keys.size() * rounds)
+        std::printf("missed %zu keys\n", keys.size() * rounds - found);
+
+    return std::chrono::duration<double, std::micro>(elapsed).count() / (rounds * keys.size());
+}
+
+} // unnamed namespace
+
+int main()
+{
+    // keys share long prefixes, like real environments do
+    std::vector<std::string> lines;
+    for (std::size_t i = 0; i < entries; i++)
+        lines.push_back("APPLICATION_SETTING_" + std::to_string(i) + "=some value for " + std::to_string(i));
+
+    std::vector<char*> block;
+    for (auto& line : lines)
+        block.push_back(line.data());
+    block.push_back(nullptr);
+
+    // spread over the block, the scan cost grows with the position
+    std::vector<std::string> keys, lower_keys;
+    for (std::size_t i = 0; i < entries; i += entries / 64) {
+        keys.push_back("APPLICATION_SETTING_" + std::to_string(i));
+        lower_keys.push_back("application_setting_" + std::to_string(i));
+    }
+
+    auto const data = block.data();
+
+    std::printf("%zu entries, us per lookup\n", entries);
+    std::printf("%-18s %12s %12s\n", "", "scalar", "matcher");
+    std::printf("%-18s %12.1f %12.1f\n", "exact",
+        bench(keys, [&](std::string_view k) { return find_scalar<std::char_traits<char>>(data, k); }),
+        bench(keys, [&](std::string_view k) { return find_entry(data, k, false); }));
+    std::printf("%-18s %12.1f %12.1f\n", "case insensitive",
+        bench(lower_keys, [&](std::string_view k) { return find_scalar<ci_char_traits>(data, k); }),
+        bench(lower_keys, [&](std::string_view k) { return find_entry(data, k, true); }));
+}
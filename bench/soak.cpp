@@ -0,0 +1,60 @@
+// rewrites a few variables over and over, like trace and request ids, and reports the resident
+// set as it goes. with setenv every replaced string is leaked, SESSIONS_OWNED_STORAGE reuses them.
+#include <unistd.h>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "red/sessions/session.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+constexpr char const* keys[] = {"SOAK_TRACE_ID", "SOAK_REQUEST_ID", "SOAK_SPAN_ID"};
+
+// resident pages from procfs, in MB
+double resident_mb()
+{
+    std::size_t size = 0, resident = 0;
+    std::ifstream{"/proc/self/statm"} >> size >> resident;
+    return double(resident * sysconf(_SC_PAGESIZE)) / (1 << 20);
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv)
+{
+    // 10^7 by default, the first argument overrides it
+    long const updates = argc > 1 ? std::atol(argv[1]) : 10'000'000;
+    long const report = updates / 10 ? updates / 10 : 1;
+
+    red::session::environment env;
+    auto vars = std::array{env[keys[0]], env[keys[1]], env[keys[2]]};
+
+#if defined(SESSIONS_OWNED_STORAGE)
+    std::puts("owned storage");
+#else
+    std::puts("setenv");
+#endif
+    std::printf("%12s %12s %12s\n", "updates", "RSS (MB)", "ns/update");
+
+    char value[32];
+    auto start = clock_type::now();
+    for (long i = 1; i <= updates; i++)
+    {
+        // ids of varying length
+        auto const end = std::to_chars(value, value + sizeof value, std::uint64_t(i) * 0x9e3779b97f4a7c15ull >> (i % 32), 16).ptr;
+        vars[i % 3] = std::string_view(value, end - value);
+
+        if (i % report == 0) {
+            auto const elapsed = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+            std::printf("%12ld %12.1f %12.1f\n", i, resident_mb(), elapsed / report);
+            start = clock_type::now();
+        }
+    }
+}
@@ -0,0 +1,72 @@
+// compares spawn() with fork + execve as the parent's heap grows.
+// fork copies the page tables of the whole address space, posix_spawn doesn't.
+#include <unistd.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <array>
+#include <memory>
+#include <string_view>
+
+#include "red/sessions/process.hpp"
+
+using namespace std::literals;
+using clock_type = std::chrono::steady_clock;
+
+extern "C" char** environ;
+
+namespace {
+
+constexpr int rounds = 200;
+constexpr auto program = "/bin/true";
+
+double per_spawn_us(clock_type::duration elapsed) {
+    return std::chrono::duration<double, std::micro>(elapsed).count() / rounds;
+}
+
+clock_type::duration bench_fork()
+{
+    char* const argv[] = {const_cast<char*>(program), nullptr};
+    auto const start = clock_type::now();
+    for (int i = 0; i < rounds; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execve(program, argv, environ);
+            _exit(127);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    return clock_type::now() - start;
+}
+
+clock_type::duration bench_spawn()
+{
+    auto const args = std::array{std::string_view{program}};
+    auto const start = clock_type::now();
+    for (int i = 0; i < rounds; i++) {
+        red::session::spawn(args).wait();
+    }
+    return clock_type::now() - start;
+}
+
+} // unnamed namespace
+
+int main()
+{
+    std::printf("%10s %14s %14s\n", "heap (MB)", "fork (us)", "spawn (us)");
+
+    for (std::size_t megabytes : {0, 64, 512})
+    {
+        // touch every page so it's really mapped
+        std::size_t const size = megabytes << 20;
+        std::unique_ptr<char[]> heap(size ? new char[size] : nullptr);
+        if (size)
+            std::memset(heap.get(), 1, size);
+
+        auto const forked = bench_fork();
+        auto const spawned = bench_spawn();
+        std::printf("%10zu %14.1f %14.1f\n", megabytes, per_spawn_us(forked), per_spawn_us(spawned));
+    }
+}
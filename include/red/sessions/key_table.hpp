@@ -0,0 +1,252 @@
+#ifndef RED_SESSIONS_KEY_TABLE_HPP
+#define RED_SESSIONS_KEY_TABLE_HPP
+
+#include <string_view>
+#include <optional>
+#include <array>
+#include <bit>
+#include <memory>
+#include <cstdint>
+
+#include "session.hpp"
+#include "options.hpp"
+
+namespace red::session {
+
+namespace detail {
+
+#if defined(WIN32)
+    constexpr bool env_ignore_case = true;
+#else
+    constexpr bool env_ignore_case = false;
+#endif
+
+    // fnv-1a, ascii letters are folded so a table also works for case insensitive keys
+    constexpr std::uint64_t key_hash(std::string_view key) noexcept
+    {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : key) {
+            if (c >= 'a' && c <= 'z')
+                c -= 'a' - 'A';
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    constexpr bool key_equal(std::string_view a, std::string_view b, bool ignore_case) noexcept
+    {
+        if (a.size() != b.size())
+            return false;
+
+        for (std::size_t i = 0; i < a.size(); i++) {
+            char x = a[i], y = b[i];
+            if (ignore_case) {
+                if (x >= 'a' && x <= 'z') x -= 'a' - 'A';
+                if (y >= 'a' && y <= 'z') y -= 'a' - 'A';
+            }
+            if (x != y)
+                return false;
+        }
+        return true;
+    }
+
+    // mixes the high half of 'hash' with a displacement
+    constexpr std::uint32_t displace(std::uint64_t hash, std::uint32_t d) noexcept
+    {
+        auto h = static_cast<std::uint32_t>(hash >> 32) ^ (d * 0x9e3779b9u);
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    // hash and displace: keys are put in buckets by the low bits of their hash. then each
+    // bucket, biggest first, looks for the displacement that sends all of its keys to free slots
+    template<std::size_t N>
+    struct perfect_hash
+    {
+        static constexpr std::size_t npos = std::size_t(-1);
+        static constexpr std::size_t buckets = std::bit_ceil(N ? N : 1);
+        static constexpr std::size_t slots = buckets * 2;
+
+        std::array<std::uint32_t, buckets> displacement{};
+        // key index + 1, 0 is empty
+        std::array<std::uint32_t, slots> index{};
+
+        constexpr explicit perfect_hash(std::array<std::string_view, N> const& keys)
+        {
+            std::array<std::uint64_t, N> hashes{};
+            std::array<std::size_t, buckets> sizes{};
+            for (std::size_t i = 0; i < N; i++) {
+                hashes[i] = key_hash(keys[i]);
+                sizes[hashes[i] & (buckets - 1)]++;
+
+                for (std::size_t j = 0; j < i; j++) {
+                    if (hashes[j] == hashes[i])
+                        throw "duplicated key, keys must differ in more than case";
+                }
+            }
+
+            std::array<std::size_t, buckets> order{};
+            for (std::size_t i = 0; i < buckets; i++) {
+                auto j = i;
+                for (; j > 0 && sizes[order[j - 1]] < sizes[i]; j--)
+                    order[j] = order[j - 1];
+                order[j] = i;
+            }
+
+            for (auto bucket : order)
+            {
+                if (sizes[bucket] == 0)
+                    break;
+
+                for (std::uint32_t d = 0; !place(keys, hashes, bucket, d); d++) {
+                    if (d == 1'000'000)
+                        throw "no perfect hash found";
+                }
+            }
+        }
+
+        // index of the only key that can match 'hash', or npos
+        constexpr std::size_t find(std::uint64_t hash) const noexcept
+        {
+            auto const d = displacement[hash & (buckets - 1)];
+            auto const i = index[displace(hash, d) & (slots - 1)];
+            return i ? i - 1 : npos;
+        }
+
+    private:
+        constexpr bool place(std::array<std::string_view, N> const& keys, std::array<std::uint64_t, N> const& hashes,
+                             std::size_t bucket, std::uint32_t d)
+        {
+            std::array<std::size_t, N> taken{};
+            std::size_t count = 0;
+
+            for (std::size_t i = 0; i < keys.size(); i++)
+            {
+                if ((hashes[i] & (buckets - 1)) != bucket)
+                    continue;
+
+                auto const slot = displace(hashes[i], d) & (slots - 1);
+                if (index[slot])
+                    return false;
+                for (std::size_t j = 0; j < count; j++) {
+                    if (taken[j] == slot)
+                        return false;
+                }
+                taken[count++] = slot;
+            }
+
+            for (std::size_t i = 0, j = 0; i < keys.size(); i++) {
+                if ((hashes[i] & (buckets - 1)) == bucket)
+                    index[taken[j++]] = static_cast<std::uint32_t>(i + 1);
+            }
+            displacement[bucket] = d;
+            return true;
+        }
+    };
+
+} // namespace detail
+
+    // keys known at compile time, looked up through a perfect hash built by the compiler.
+    //
+    //   using config_keys = key_table<"LOG_LEVEL", "HOME">;
+    //   auto config = config_keys::resolve();
+    //   config.get<"LOG_LEVEL">();
+    template<meta::fixed_string... Keys>
+    class key_table
+    {
+    public:
+        static constexpr std::size_t npos = std::size_t(-1);
+        static constexpr std::size_t size = sizeof...(Keys);
+        static constexpr std::array<std::string_view, size> keys{ Keys.view()... };
+
+        // index of 'key' or npos, one hash and one compare
+        static constexpr std::size_t find(std::string_view key, bool ignore_case = false) noexcept
+        {
+            auto const i = perfect.find(detail::key_hash(key));
+            return i != npos && detail::key_equal(keys[i], key, ignore_case) ? i : npos;
+        }
+
+        template<meta::fixed_string Key>
+        static constexpr std::size_t index_of() noexcept
+        {
+            constexpr auto i = find(Key.view());
+            static_assert(i != npos, "not a key of this table");
+            return i;
+        }
+
+        // the values of every key, looked up once
+        class values
+        {
+        public:
+            std::optional<std::string_view> operator [] (std::size_t i) const noexcept {
+                if (!m_found[i])
+                    return std::nullopt;
+                return m_values[i];
+            }
+
+            template<meta::fixed_string Key>
+            std::optional<std::string_view> get() const noexcept {
+                return (*this)[index_of<Key>()];
+            }
+
+            template<meta::fixed_string Key>
+            bool contains() const noexcept {
+                return m_found[index_of<Key>()];
+            }
+
+        private:
+            friend class key_table;
+
+            std::array<std::string_view, size> m_values{};
+            std::array<bool, size> m_found{};
+            // keeps the views valid
+            std::shared_ptr<const void> m_owner;
+        };
+
+        // one probe of the snapshot's index per key, the values share the snapshot.
+        // like getenv, the first of duplicated keys wins
+        static values resolve(std::shared_ptr<const environment::snapshot> snap = environment::snapshot::current())
+        {
+            values result;
+            for (std::size_t i = 0; i < size; i++)
+            {
+                auto const it = snap->find(keys[i]);
+                if (it == snap->end())
+                    continue;
+
+                // entries without '=' aren't variables
+                std::string_view const line = *it;
+                if (line.size() <= keys[i].size() || line[keys[i].size()] != '=')
+                    continue;
+
+                result.m_values[i] = line.substr(keys[i].size() + 1);
+                result.m_found[i] = true;
+            }
+            result.m_owner = std::move(snap);
+            return result;
+        }
+
+        // keys are spelled like on the command line, options without a value are empty
+        static values resolve(options const& opts)
+        {
+            values result;
+            for (std::size_t i = 0; i < size; i++) {
+                if (opts.has(keys[i])) {
+                    result.m_values[i] = opts.value(keys[i]).value_or(std::string_view{});
+                    result.m_found[i] = true;
+                }
+            }
+            return result;
+        }
+
+    private:
+        static constexpr detail::perfect_hash<size> perfect{keys};
+    };
+
+} /* namespace red::session */
+
+#endif /* RED_SESSIONS_KEY_TABLE_HPP */
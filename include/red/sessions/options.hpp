@@ -0,0 +1,123 @@
+#ifndef RED_SESSIONS_OPTIONS_HPP
+#define RED_SESSIONS_OPTIONS_HPP
+
+#include <string_view>
+#include <optional>
+#include <vector>
+#include <initializer_list>
+#include <cstdint>
+
+#include "session.hpp"
+
+namespace red::session {
+
+namespace detail {
+
+    struct option_entry
+    {
+        std::string_view name;      // without dashes
+        std::string_view value;
+        std::uint32_t hash;
+        std::uint32_t count;        // occurrences of this name up to here
+        bool is_short;
+        bool has_value;
+    };
+
+} // namespace detail
+
+    // command line options, tokenized once. names and values are views into the arguments.
+    //
+    // '--name=value' is a long option with a value, '-abc' are the short options a, b and c.
+    // options declared to take values also take the next argument, '--name value' or '-o value',
+    // and a short one takes the rest of its group, '-ovalue'. the rest are flags, so a token that
+    // doesn't start with '-' after them is positional. negative numbers like '-1' are never options.
+    // '--' ends the options, everything after it is positional.
+    class options
+    {
+    public:
+        options() : options(arguments{}) {}
+
+        // 'with_values' are spelled like on the command line: {"--name", "-o"}
+        explicit options(std::initializer_list<std::string_view> with_values) : options(arguments{}, with_values) {}
+
+        // 'args' are like argv, the first one is the program. they must outlive the options
+        template<class Rng>
+            requires ranges::range<Rng> && std::convertible_to<ranges::range_value_t<Rng>, std::string_view>
+        explicit options(Rng&& args, std::initializer_list<std::string_view> with_values = {})
+        {
+            bool first = true;
+            for (std::string_view arg : args) {
+                if (first) {
+                    m_program = arg;
+                    first = false;
+                }
+                else parse(arg, with_values);
+            }
+            build_index();
+        }
+
+        // names are spelled like on the command line: "--verbose" or "-v"
+        [[nodiscard]]
+        bool has(std::string_view name) const noexcept { return find(name) != nullptr; }
+
+        // how many times 'name' was given
+        std::size_t count(std::string_view name) const noexcept {
+            auto e = find(name);
+            return e ? e->count : 0;
+        }
+
+        // the value of the last 'name', if it has one
+        std::optional<std::string_view> value(std::string_view name) const noexcept {
+            auto e = find(name);
+            if (!e || !e->has_value)
+                return std::nullopt;
+            return e->value;
+        }
+
+        // the value of the last 'name' converted by value_parser<T>.
+        // a bool option given without a value is true
+        template<class T>
+        std::optional<T> get(std::string_view name) const
+        {
+            auto e = find(name);
+            if (!e)
+                return std::nullopt;
+
+            if constexpr (std::same_as<T, bool>) {
+                if (!e->has_value)
+                    return true;
+            }
+            if (!e->has_value)
+                return std::nullopt;
+
+            return value_parser<T>::parse(e->value);
+        }
+
+        template<class T>
+        T get(std::string_view name, T fallback) const {
+            return get<T>(name).value_or(fallback);
+        }
+
+        std::string_view program() const noexcept { return m_program; }
+
+        // arguments that are not options or their values
+        std::vector<std::string_view> const& positional() const noexcept { return m_positional; }
+
+    private:
+        void parse(std::string_view arg, std::initializer_list<std::string_view> with_values);
+        void build_index();
+        detail::option_entry const* find(std::string_view name) const noexcept;
+
+        std::vector<detail::option_entry> m_entries;
+        std::vector<std::string_view> m_positional;
+        // open addressing, entry index + 1 of the last occurrence of a name. 0 is empty
+        std::vector<std::uint32_t> m_slots;
+        std::string_view m_program;
+        // entry index + 1 of the option waiting for the next argument, 0 is none
+        std::size_t m_pending = 0;
+        bool m_only_positional = false;
+    };
+
+} /* namespace red::session */
+
+#endif /* RED_SESSIONS_OPTIONS_HPP */
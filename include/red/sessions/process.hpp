@@ -0,0 +1,109 @@
+#ifndef RED_SESSIONS_PROCESS_HPP
+#define RED_SESSIONS_PROCESS_HPP
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "session.hpp"
+
+namespace red::session {
+
+    // a process started by spawn()
+    class child
+    {
+    public:
+#if defined(WIN32)
+        using native_handle_type = void*;
+#else
+        using native_handle_type = int;
+#endif
+
+        child() = default;
+        explicit child(native_handle_type handle) noexcept : m_handle(handle) {}
+
+        child(child&& other) noexcept
+        : m_handle(std::exchange(other.m_handle, native_handle_type{}))
+        {}
+        child& operator=(child&& other) noexcept {
+            std::swap(m_handle, other.m_handle);
+            return *this;
+        }
+
+        // doesn't wait. on posix, a process that's not waited for is reaped here if it exited,
+        // or by a later spawn, so it doesn't stay a zombie
+        ~child();
+
+        // waits for the process to exit and returns its exit code, after that the child isn't valid.
+        // on posix, a process killed by a signal returns 128 + the signal number.
+        // throws std::system_error if the child isn't valid
+        int wait();
+
+        [[nodiscard]]
+        bool valid() const noexcept { return m_handle != native_handle_type{}; }
+
+        native_handle_type native_handle() const noexcept { return m_handle; }
+
+    private:
+        native_handle_type m_handle{};
+    };
+
+namespace detail {
+
+    // starts argv[0], searching PATH if it's not a path. a null envp inherits the environment,
+    // with this thread's overlay.
+    // uses posix_spawn on posix, which doesn't copy the address space like fork does.
+    // throws std::invalid_argument if argv is empty
+    child spawn(char const* const* argv, char const* const* envp);
+
+    // null terminated copies of a range of strings, in one buffer
+    class cstring_array
+    {
+    public:
+        template<class Rng>
+        explicit cstring_array(Rng&& rng)
+        {
+            std::size_t count = 0;
+            for (std::string_view s : rng) {
+                m_buffer.append(s).push_back('\0');
+                count++;
+            }
+
+            m_pointers.reserve(count + 1);
+            for (std::size_t i = 0, offset = 0; i < count; i++) {
+                m_pointers.push_back(m_buffer.data() + offset);
+                offset += std::char_traits<char>::length(m_buffer.data() + offset) + 1;
+            }
+            m_pointers.push_back(nullptr);
+        }
+
+        char const* const* data() const noexcept { return m_pointers.data(); }
+
+    private:
+        std::string m_buffer;
+        std::vector<char const*> m_pointers;
+    };
+
+} // namespace detail
+
+    // starts a process with 'args' as its arguments, the first one names the program.
+    // it gets the environment built by 'env'
+    template<class Rng>
+        requires ranges::range<Rng> && std::convertible_to<ranges::range_value_t<Rng>, std::string_view>
+    child spawn(Rng&& args, environment::envp_builder& env) {
+        detail::cstring_array argv(args);
+        return detail::spawn(argv.data(), env.build());
+    }
+
+    // starts a process with 'args' as its arguments, it inherits the environment
+    template<class Rng>
+        requires ranges::range<Rng> && std::convertible_to<ranges::range_value_t<Rng>, std::string_view>
+    child spawn(Rng&& args) {
+        detail::cstring_array argv(args);
+        return detail::spawn(argv.data(), nullptr);
+    }
+
+} /* namespace red::session */
+
+#endif /* RED_SESSIONS_PROCESS_HPP */
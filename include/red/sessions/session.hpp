@@ -5,15 +5,25 @@
 #include <string_view>
 #include <string>
 #include <concepts>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <charconv>
+#include <chrono>
+#include <stdexcept>
+#include <filesystem>
+#include <memory_resource>
+#include <algorithm>
 
-#include <range/v3/action/split.hpp>
 #include <range/v3/view/join.hpp>
 #include <range/v3/view/subrange.hpp>
 #include <range/v3/view/transform.hpp>
 #include <range/v3/iterator/basic_iterator.hpp>
 #include <range/v3/range/conversion.hpp>
 
-#include "config.h"
+#include "red/sessions/config.h"
 
 namespace red::session {
 
@@ -24,6 +34,21 @@ namespace meta
 
     template <class T>
     concept not_cstr = sv_convertible<T> && !std::convertible_to<const T&, const char*>;
+
+    // a string literal usable as a template argument
+    template <std::size_t N>
+    struct fixed_string
+    {
+        char chars[N]{};
+
+        constexpr fixed_string(char const (&s)[N]) {
+            for (std::size_t i = 0; i < N; i++)
+                chars[i] = s[i];
+        }
+
+        constexpr std::string_view view() const noexcept { return {chars, N - 1}; }
+        constexpr operator std::string_view() const noexcept { return view(); }
+    };
 }
 
 // impl detail
@@ -31,6 +56,13 @@ namespace detail {
 
     std::string narrow_copy(envchar const* s);
 
+    // an entry split into key and value
+    struct key_value
+    {
+        std::string_view key;
+        std::string_view value;
+    };
+
     // cursor over an array of pointers where the end is nullptr
     template<typename T>
     class ptr_array_cursor
@@ -65,12 +97,245 @@ namespace detail {
         }
     };
 
+    // cursor that views the entries in place, no copies are made
+    template<typename T>
+    struct view_cursor : ptr_array_cursor<T>
+    {
+        using ptr_array_cursor<T>::ptr_array_cursor;
+        using value_type = std::basic_string_view<T>;
+
+        value_type read() const noexcept {
+            return ptr_array_cursor<T>::read();
+        }
+    };
+
+    using envview_cursor = view_cursor<envchar>;
+
+
+    // snapshot layout: a header, the entry table sorted by key, the hash index and the strings.
+    // it's position independent, so it can be saved and mapped as is.
+    struct snapshot_header
+    {
+        char magic[8];              // "REDSNAP"
+        std::uint32_t byte_order;   // 0x01020304 on the writer
+        std::uint32_t version;
+        std::uint32_t flags;
+        std::uint32_t count;        // entries
+        std::uint32_t slots;        // hash index size, a power of 2
+        std::uint32_t reserved;
+        std::uint64_t strings_size;
+    };
+
+    // offsets are relative to the string area
+    struct snapshot_entry
+    {
+        std::uint32_t offset; // start of "key=value"
+        std::uint32_t keylen;
+        std::uint32_t length;
+    };
+
+    // hash index slot, 'entry' is 1-based and 0 marks an empty slot
+    struct snapshot_slot
+    {
+        std::uint32_t hash;
+        std::uint32_t entry;
+    };
+
+    // cursor over a snapshot's entry table
+    class snapshot_cursor
+    {
+        snapshot_entry const* ent = nullptr;
+        char const* strings = nullptr;
+    public:
+        void next() noexcept { ent++; }
+        void prev() noexcept { ent--; }
+        void advance(std::ptrdiff_t n) noexcept { ent += n; }
+        std::string_view read() const noexcept {
+            return { strings + ent->offset, ent->length };
+        }
+        std::ptrdiff_t distance_to(snapshot_cursor const& that) const noexcept {
+            return that.ent - ent;
+        }
+        bool equal(snapshot_cursor const& other) const noexcept {
+            return ent == other.ent;
+        }
+
+        snapshot_cursor()=default;
+        snapshot_cursor(snapshot_entry const* e, char const* s) : ent(e), strings(s) {}
+    };
+
+    // cursor over a snapshot's entries split into key and value, the first 'skip' chars of the keys are dropped
+    class key_value_cursor
+    {
+        snapshot_entry const* ent = nullptr;
+        char const* strings = nullptr;
+        std::size_t skip = 0;
+    public:
+        void next() noexcept { ent++; }
+        void prev() noexcept { ent--; }
+        void advance(std::ptrdiff_t n) noexcept { ent += n; }
+        key_value read() const noexcept {
+            std::string_view const line{ strings + ent->offset, ent->length };
+            auto const value = ent->keylen < ent->length ? line.substr(ent->keylen + 1) : line.substr(ent->length);
+            return { line.substr(skip, ent->keylen - skip), value };
+        }
+        std::ptrdiff_t distance_to(key_value_cursor const& that) const noexcept {
+            return that.ent - ent;
+        }
+        bool equal(key_value_cursor const& other) const noexcept {
+            return ent == other.ent;
+        }
+
+        key_value_cursor()=default;
+        key_value_cursor(snapshot_entry const* e, char const* s, std::size_t skip_) : ent(e), strings(s), skip(skip_) {}
+    };
+
+
+    // cursor over the pieces of a string separated by 'sep'
+    class split_cursor
+    {
+        char const* first = nullptr; // start of the current piece, nullptr at the end
+        char const* stop = nullptr;
+        char const* last = nullptr;
+        char sep = 0;
+
+        void scan() noexcept {
+            auto const found = std::char_traits<char>::find(first, static_cast<std::size_t>(last - first), sep);
+            stop = found ? found : last;
+        }
+    public:
+        void next() noexcept {
+            if (stop == last) {
+                first = nullptr;
+                return;
+            }
+            first = stop + 1;
+            scan();
+        }
+        std::string_view read() const noexcept {
+            return { first, static_cast<std::size_t>(stop - first) };
+        }
+        bool equal(split_cursor const& other) const noexcept {
+            return first == other.first;
+        }
+        bool equal(ranges::default_sentinel_t) const noexcept {
+            return first == nullptr;
+        }
+
+        split_cursor()=default;
+        split_cursor(std::string_view s, char sep_) : last(s.data() + s.size()), sep(sep_) {
+            if (!s.empty()) {
+                first = s.data();
+                scan();
+            }
+        }
+    };
+
+
+    // sets and erasures staged in a single buffer, the last change to a key wins
+    class staged_changes
+    {
+    public:
+        struct change
+        {
+            std::size_t offset; // "key=value", or "key" for erasures
+            std::size_t keylen;
+            std::size_t length;
+            bool erase;
+            bool matched;
+        };
+
+        void set(std::string_view key, std::string_view value);
+        void erase(std::string_view key);
+
+        void clear() noexcept {
+            m_buffer.clear();
+            m_changes.clear();
+        }
+        bool empty() const noexcept { return m_changes.empty(); }
+
+        // sorts the changes by key, dropping all but the last one to each key
+        std::vector<change>& resolve();
+
+        // what's staged so far, to drop anything staged after it
+        struct marker
+        {
+            std::size_t changes;
+            std::size_t buffer;
+            bool resolved;
+        };
+        marker mark() const noexcept { return { m_changes.size(), m_buffer.size(), m_resolved }; }
+        void rollback(marker m) noexcept {
+            m_changes.resize(m.changes);
+            m_buffer.resize(m.buffer);
+            m_resolved = m.resolved;
+        }
+
+        std::string_view line(change const& c) const noexcept {
+            return { m_buffer.data() + c.offset, c.length };
+        }
+        std::string_view key(change const& c) const noexcept {
+            return { m_buffer.data() + c.offset, c.keylen };
+        }
+        std::string_view value(change const& c) const noexcept {
+            return c.erase ? std::string_view() : line(c).substr(c.keylen + 1);
+        }
+
+    private:
+        std::string m_buffer;
+        std::vector<change> m_changes;
+        bool m_resolved = true;
+    };
+
+
+    // a null terminated copy of a string, kept inline when it's short
+    class small_string
+    {
+    public:
+        explicit small_string(std::string_view s) { assign(s); }
+
+        small_string(small_string const& other) { assign(other.view()); }
+        small_string& operator=(small_string const& other) {
+            if (this != &other)
+                assign(other.view());
+            return *this;
+        }
+
+        std::string_view view() const noexcept { return { data(), m_size }; }
+        char const* c_str() const noexcept { return data(); }
+
+    private:
+        static constexpr std::size_t inline_size = 63;
+
+        char const* data() const noexcept { return m_heap ? m_heap.get() : m_inline; }
+
+        void assign(std::string_view s)
+        {
+            char* buffer = m_inline;
+            if (s.size() > inline_size) {
+                m_heap = std::make_unique<char[]>(s.size() + 1);
+                buffer = m_heap.get();
+            }
+            else m_heap.reset();
+
+            s.copy(buffer, s.size());
+            buffer[s.size()] = '\0';
+            m_size = s.size();
+        }
+
+        std::size_t m_size = 0;
+        char m_inline[inline_size + 1];
+        std::unique_ptr<char[]> m_heap;
+    };
+
 
     struct keyval_fn
     {
         explicit keyval_fn(bool key) : getkey(key) {}
 
-        auto operator() (std::string const& line) const noexcept
+        // works on both owning strings and views, returning the same kind
+        template<class Str>
+        Str operator() (Str const& line) const noexcept
         {
             auto const eq = line.find('=');
             return getkey ? line.substr(0, eq) : line.substr(eq+1);
@@ -79,32 +344,247 @@ namespace detail {
     private:
         bool getkey;
     };
+
+    // like keyval_fn, copying the piece into memory from 'resource'
+    struct pmr_keyval_fn
+    {
+        pmr_keyval_fn(bool key, std::pmr::memory_resource* resource) : getkey(key), resource(resource) {}
+
+        std::pmr::string operator() (std::string_view line) const
+        {
+            return std::pmr::string(keyval_fn(getkey)(line), resource);
+        }
+
+    private:
+        bool getkey;
+        std::pmr::memory_resource* resource;
+    };
     
 } // namespace detail
 
 
+    // lazily splits a string at 'sep', yielding views into a buffer shared by all copies.
+    // an empty string has no pieces, otherwise every separator starts a new one.
+    class split_view : public ranges::basic_view<ranges::finite>
+    {
+    public:
+        using iterator = ranges::basic_iterator<detail::split_cursor>;
+
+        split_view() = default;
+        split_view(std::string_view s, char sep);
+        // the buffer comes from 'resource'
+        split_view(std::string_view s, char sep, std::pmr::memory_resource* resource);
+
+        auto begin() const noexcept {
+            return iterator(detail::split_cursor({m_buffer.get(), m_size}, m_sep));
+        }
+        auto end() const noexcept {
+            return ranges::default_sentinel;
+        }
+
+    private:
+        std::shared_ptr<const char[]> m_buffer;
+        std::size_t m_size = 0;
+        char m_sep = 0;
+    };
+
+    static_assert(ranges::forward_range<split_view>);
+
+
+    // converts text to T, the whole string must match. specialize it to parse your own types
+    template<class T>
+    struct value_parser;
+
+    template<class T>
+        requires (std::integral<T> || std::floating_point<T>) && (!std::same_as<T, bool>)
+    struct value_parser<T>
+    {
+        static std::optional<T> parse(std::string_view s) noexcept {
+            T value{};
+            auto const last = s.data() + s.size();
+            auto const [ptr, ec] = std::from_chars(s.data(), last, value);
+            if (ec != std::errc{} || ptr != last)
+                return std::nullopt;
+
+            return value;
+        }
+    };
+
+    template<>
+    struct value_parser<bool>
+    {
+        // 1, true, yes, on and 0, false, no, off. in any case
+        static std::optional<bool> parse(std::string_view s) noexcept {
+            auto const is = [s](std::string_view word) {
+                if (s.size() != word.size())
+                    return false;
+                for (std::size_t i = 0; i < s.size(); i++) {
+                    if ((s[i] | 0x20) != word[i])
+                        return false;
+                }
+                return true;
+            };
+
+            if (s == "1" || is("true") || is("yes") || is("on"))
+                return true;
+            if (s == "0" || is("false") || is("no") || is("off"))
+                return false;
+            return std::nullopt;
+        }
+    };
+
+    // the underlying integer, specialize value_parser for names
+    template<class T>
+        requires std::is_enum_v<T>
+    struct value_parser<T>
+    {
+        static std::optional<T> parse(std::string_view s) noexcept {
+            auto const value = value_parser<std::underlying_type_t<T>>::parse(s);
+            if (!value)
+                return std::nullopt;
+            return static_cast<T>(*value);
+        }
+    };
+
+    // a number followed by ns, us, ms, s, m or min, h. without a unit it counts Period
+    template<class Rep, class Period>
+    struct value_parser<std::chrono::duration<Rep, Period>>
+    {
+        using duration = std::chrono::duration<Rep, Period>;
+
+        static std::optional<duration> parse(std::string_view s) noexcept {
+            Rep count{};
+            auto const last = s.data() + s.size();
+            auto const [ptr, ec] = std::from_chars(s.data(), last, count);
+            if (ec != std::errc{})
+                return std::nullopt;
+
+            auto const unit = std::string_view(ptr, last - ptr);
+            if (unit.empty()) return duration(count);
+            if (unit == "ns") return in<std::nano>(count);
+            if (unit == "us") return in<std::micro>(count);
+            if (unit == "ms") return in<std::milli>(count);
+            if (unit == "s") return in<std::ratio<1>>(count);
+            if (unit == "m" || unit == "min") return in<std::ratio<60>>(count);
+            if (unit == "h") return in<std::ratio<3600>>(count);
+            return std::nullopt;
+        }
+
+    private:
+        template<class P>
+        static duration in(Rep count) noexcept {
+            return std::chrono::duration_cast<duration>(std::chrono::duration<Rep, P>(count));
+        }
+    };
+
+    template<class T>
+        requires std::same_as<T, std::string_view> || std::same_as<T, std::string>
+    struct value_parser<T>
+    {
+        static std::optional<T> parse(std::string_view s) {
+            return T(s);
+        }
+    };
+
+
+    class child;
+
+namespace detail {
+    // in process.hpp
+    child spawn(char const* const* argv, char const* const* envp);
+}
+
+    // lookups, changes and size() are safe to call from any thread, changes are serialized.
+    // iterators read the live block though, concurrent readers should use snapshot::current().
     class environment : public ranges::basic_view<ranges::finite>
     {
+#if defined(WIN32)
+        // the environment is wide, entries must be converted
         using cursor = detail::narrowing_cursor;
+#else
+        // the environment is already narrow, iterate it in place
+        using cursor = detail::envview_cursor;
+#endif
         cursor begin_cursor() const;
 
     public:
         // the separator char. used in the PATH variable
         static const char path_separator;
 
+        class snapshot;
+        class overlay;
+        class transaction;
+        class envp_builder;
+        template<class T>
+        class cached;
+        class value_list;
+        class entry_list;
+        class prefix_view;
+        class expansion;
+
+        using key_value = detail::key_value;
+
         class variable
         {
         public:
             friend class environment;
         
-            std::string_view key() const noexcept { return m_key; }
+            std::string_view key() const noexcept { return m_key.view(); }
             std::string value() const;
             operator std::string() const { return value(); }
 
-            auto split (char sep = environment::path_separator) const {
-                return ranges::actions::split(value(), sep);
+            // the value converted by value_parser<T>, parsed straight from the entry.
+            // empty if the variable doesn't exist or doesn't convert
+            template<class T>
+            std::optional<T> try_as() const
+            {
+                static_assert(!std::same_as<T, std::string_view>, "the view would outlive the entry");
+
+                std::optional<T> result;
+                read([](void* out, std::string_view value) {
+                    *static_cast<std::optional<T>*>(out) = value_parser<T>::parse(value);
+                }, &result);
+                return result;
+            }
+
+            // like try_as, but throws std::invalid_argument if it's empty
+            template<class T>
+            T as() const
+            {
+                if (auto value = try_as<T>())
+                    return *std::move(value);
+
+                throw std::invalid_argument("environment variable '" + std::string(key()) + "' can't be converted");
             }
 
+            // copies the value into 'out', reusing its capacity. false if the variable doesn't exist
+            template<class Alloc>
+            bool value_into(std::basic_string<char, std::char_traits<char>, Alloc>& out) const
+            {
+                bool found = false;
+                auto context = std::pair{&out, &found};
+                read([](void* c, std::string_view value) {
+                    auto [str, found] = *static_cast<decltype(context)*>(c);
+                    str->assign(value);
+                    *found = true;
+                }, &context);
+
+                if (!found)
+                    out.clear();
+                return found;
+            }
+
+            // the value in memory from 'resource'
+            std::pmr::string value(std::pmr::memory_resource* resource) const {
+                std::pmr::string result(resource);
+                value_into(result);
+                return result;
+            }
+
+            // the value's pieces, computed as they're iterated
+            split_view split (char sep = environment::path_separator) const;
+            split_view split (char sep, std::pmr::memory_resource* resource) const;
+
             variable& operator=(std::string_view value);
 
         private:
@@ -112,14 +592,26 @@ namespace detail {
             : m_key(key_)
             {}
 
-            std::string m_key;
+            // calls 'fn' with a view of the value, valid only during the call
+            template<class Fn>
+            decltype(auto) visit(Fn&& fn) const;
+
+            // calls 'fn' with 'context' and a view of the value, only if the variable exists
+            void read(void (*fn)(void*, std::string_view), void* context) const;
+
+            // short keys don't allocate
+            detail::small_string m_key;
         };
 
         using iterator = ranges::basic_iterator<cursor>;
+        // type of the entries, std::string_view on posix and std::string on windows
+        using string_type = cursor::value_type;
         using value_type = variable;
         using size_type = std::size_t;
         using value_range = ranges::transform_view<environment,detail::keyval_fn>;
         using key_range = value_range;
+        using pmr_value_range = ranges::transform_view<environment,detail::pmr_keyval_fn>;
+        using pmr_key_range = pmr_value_range;
 
         environment() noexcept;
 
@@ -129,8 +621,17 @@ namespace detail {
 
         iterator find(meta::sv_convertible auto const& key) const noexcept { return do_find(key); }
 
+        // true if 'key' exists, even with an empty value
         bool contains(std::string_view key) const;
 
+        // the values of 'keys' in the same order, found in one pass over the environment
+        template<meta::sv_convertible... Keys>
+        value_list get_many(Keys const&... keys) const;
+
+        template<class Rng>
+            requires ranges::range<Rng> && std::convertible_to<ranges::range_value_t<Rng>, std::string_view>
+        value_list get_many(Rng&& keys) const;
+
         auto begin() const noexcept {
             return iterator(begin_cursor());
         }
@@ -141,15 +642,37 @@ namespace detail {
         }
         auto cend() const noexcept { return end(); }
 
-        size_type size () const noexcept {
-            return ranges::distance(begin(), end());
-        }
+        // constant time, the count is kept by the library's own changes
+        size_type size () const noexcept;
 
         [[nodiscard]]
         bool empty() const noexcept { return size() == 0; }
 
         void erase(meta::sv_convertible auto const& key) { do_erase(key); }
 
+        // lookups are cached per thread, keyed on this counter. it's bumped by every
+        // change made through the library and by touch().
+        static std::uint64_t generation() noexcept;
+
+        // announces a change made behind the library's back, e.g. a raw ::setenv or putenv.
+        // replaced values are picked up on their own, but new variables won't be found until
+        // the environment block moves or touch() is called.
+        static void touch() noexcept;
+
+        // every entry split into key and value, captured in one pass
+        entry_list entries() const;
+
+        // the entries whose keys start with 'prefix', from snapshot::current() or this thread's overlay.
+        // 'strip' drops the prefix from the keys
+        prefix_view with_prefix(std::string_view prefix, bool strip = false) const;
+
+        // 'text' with $VAR, ${VAR} and ${VAR:-default} replaced by their values, see expansion.
+        // throws std::invalid_argument if 'text' is malformed
+        std::string expand(std::string_view text) const;
+
+        template<class OutputIt>
+        OutputIt expand(std::string_view text, OutputIt out) const;
+
         value_range values() const noexcept {
             return ranges::views::transform(*this, detail::keyval_fn(false));
         }
@@ -157,14 +680,444 @@ namespace detail {
             return ranges::views::transform(*this, detail::keyval_fn(true));
         }
 
+        // copies of the values and keys, in memory from 'resource'
+        pmr_value_range values(std::pmr::memory_resource* resource) const noexcept {
+            return ranges::views::transform(*this, detail::pmr_keyval_fn(false, resource));
+        }
+        pmr_key_range keys(std::pmr::memory_resource* resource) const noexcept {
+            return ranges::views::transform(*this, detail::pmr_keyval_fn(true, resource));
+        }
+
     private:
         void do_erase(std::string_view key);
         iterator do_find(std::string_view k) const;
+
+        // the process' block, or the active overlay's. callers hold the environment's lock
+        static detail::envblock effective_block();
+
+        // children inherit the effective block
+        friend child detail::spawn(char const* const* argv, char const* const* envp);
+
+        // true if this thread has an overlay
+        static bool overlay_active() noexcept;
+
+        // parses 'text' and calls 'fn' with 'context' and each piece of the result, in order.
+        // references are looked up in this thread's overlay first, then in 'snap'
+        static void do_expand(std::string_view text, snapshot const& snap, void (*fn)(void*, std::string_view), void* context);
+
+        static value_list do_get_many(std::string_view const* keys, std::size_t count);
     };
 
     static_assert(ranges::bidirectional_range<environment>);
 
 
+    // values found by environment::get_many, copied into one buffer
+    class environment::value_list
+    {
+    public:
+        using size_type = std::size_t;
+
+        // the value of the i-th key, empty if it wasn't found
+        std::optional<std::string_view> operator [] (size_type i) const noexcept {
+            auto const [offset, length] = m_values[i];
+            if (offset == missing)
+                return std::nullopt;
+            return std::string_view(m_buffer).substr(offset, length);
+        }
+
+        size_type size() const noexcept { return m_values.size(); }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return m_values.empty(); }
+
+    private:
+        friend class environment;
+
+        struct span
+        {
+            std::uint32_t offset;
+            std::uint32_t length;
+        };
+        static constexpr auto missing = std::uint32_t(-1);
+
+        std::string m_buffer;
+        std::vector<span> m_values;
+    };
+
+    // entries captured by environment::entries(), copied into one buffer so they stay valid
+    // after the environment changes. it's random access, usable with parallel algorithms.
+    class environment::entry_list
+    {
+    public:
+        using value_type = key_value;
+        using size_type = std::size_t;
+        using iterator = std::vector<key_value>::const_iterator;
+
+        iterator begin() const noexcept { return m_entries.begin(); }
+        iterator end() const noexcept { return m_entries.end(); }
+
+        key_value const& operator [] (size_type i) const noexcept { return m_entries[i]; }
+
+        size_type size() const noexcept { return m_entries.size(); }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return m_entries.empty(); }
+
+    private:
+        friend class environment;
+
+        std::unique_ptr<char[]> m_strings;
+        std::vector<key_value> m_entries;
+    };
+
+    static_assert(ranges::random_access_range<environment::entry_list>);
+
+    template<meta::sv_convertible... Keys>
+    auto environment::get_many(Keys const&... keys) const -> value_list {
+        std::string_view const views[] = { std::string_view(keys)..., {} };
+        return do_get_many(views, sizeof...(Keys));
+    }
+
+    template<class Rng>
+        requires ranges::range<Rng> && std::convertible_to<ranges::range_value_t<Rng>, std::string_view>
+    auto environment::get_many(Rng&& keys) const -> value_list {
+        std::vector<std::string_view> views;
+        for (std::string_view key : keys)
+            views.push_back(key);
+        return do_get_many(views.data(), views.size());
+    }
+
+
+    // a variable parsed as T, parsed again only after the environment changes.
+    // changes are seen through environment::generation(), and an active overlay always parses.
+    // not thread-safe, keep one per thread.
+    template<class T>
+    class environment::cached
+    {
+    public:
+        explicit cached(std::string_view key) : m_variable(key) {}
+
+        std::optional<T> get() const
+        {
+            auto const generation = environment::generation();
+            if (environment::overlay_active())
+                return m_variable.try_as<T>();
+
+            if (!m_parsed || generation != m_generation) {
+                m_value = m_variable.try_as<T>();
+                m_generation = generation;
+                m_parsed = true;
+            }
+            return m_value;
+        }
+
+        T get(T fallback) const { return get().value_or(std::move(fallback)); }
+
+        std::string_view key() const noexcept { return m_variable.key(); }
+
+    private:
+        variable m_variable;
+        mutable std::optional<T> m_value;
+        mutable std::uint64_t m_generation = 0;
+        mutable bool m_parsed = false;
+    };
+
+
+    // an immutable copy of the environment, sorted by key and hash indexed.
+    // once built, lookups are a single probe and make no syscalls or allocations.
+    class environment::snapshot
+    {
+    public:
+        using iterator = ranges::basic_iterator<detail::snapshot_cursor>;
+        using value_type = std::string_view;
+        using size_type = std::size_t;
+
+        // captures the current environment
+        snapshot();
+
+        // the latest published snapshot, rebuilt once per generation. this is the way to read
+        // the environment from many threads: readers never touch the live block, and changes
+        // made through the library are serialized and picked up by the next call.
+        static std::shared_ptr<const snapshot> current();
+
+        // maps a file written by save(), nothing is parsed or copied. processes that load the
+        // same file share its pages. the header and the bounds of the tables are checked.
+        // throws std::system_error if it can't be mapped or isn't a snapshot from this platform
+        static std::shared_ptr<const snapshot> load(std::filesystem::path const& path);
+
+        // writes the snapshot as it's laid out in memory. the file is replaced through a rename,
+        // so processes that loaded the old one keep reading it
+        void save(std::filesystem::path const& path) const;
+
+        // environment::generation() at the time of capture, 0 for loaded snapshots
+        std::uint64_t generation() const noexcept { return m_generation; }
+
+        // value of 'key', empty if not found
+        std::string_view operator [] (std::string_view key) const noexcept;
+
+        iterator find(std::string_view key) const noexcept;
+
+        bool contains(std::string_view key) const noexcept { return lookup(key) != nullptr; }
+
+        // the entries whose keys start with 'prefix', two binary searches of the sorted table.
+        // 'strip' drops the prefix from the keys. the view is valid while the snapshot is
+        prefix_view with_prefix(std::string_view prefix, bool strip = false) const noexcept;
+
+        iterator begin() const noexcept {
+            return iterator(detail::snapshot_cursor(m_entries, m_strings));
+        }
+        iterator end() const noexcept {
+            return iterator(detail::snapshot_cursor(m_entries + m_count, m_strings));
+        }
+
+        size_type size() const noexcept { return m_count; }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return m_count == 0; }
+
+    private:
+        // captures 'block', callers hold the environment's lock
+        explicit snapshot(detail::envblock block);
+        snapshot(std::shared_ptr<const std::byte[]> data, std::size_t size);
+        void build(detail::envblock block);
+        // points the tables into 'data', which starts with a header
+        void attach(std::shared_ptr<const std::byte[]> data, std::size_t size);
+
+        detail::snapshot_entry const* lookup(std::string_view key) const noexcept;
+
+        std::shared_ptr<const std::byte[]> m_data;
+        std::size_t m_size = 0;
+        detail::snapshot_entry const* m_entries = nullptr;
+        detail::snapshot_slot const* m_slots = nullptr;
+        char const* m_strings = nullptr;
+        std::uint32_t m_count = 0;
+        std::uint32_t m_mask = 0;
+        std::uint64_t m_generation = 0;
+    };
+
+    static_assert(ranges::random_access_range<environment::snapshot>);
+
+
+    // a run of snapshot entries that share a key prefix, split into key and value
+    class environment::prefix_view
+    {
+    public:
+        using iterator = ranges::basic_iterator<detail::key_value_cursor>;
+        using value_type = key_value;
+        using size_type = std::size_t;
+
+        prefix_view() = default;
+
+        iterator begin() const noexcept {
+            return iterator(detail::key_value_cursor(m_first, m_strings, m_skip));
+        }
+        iterator end() const noexcept {
+            return iterator(detail::key_value_cursor(m_last, m_strings, m_skip));
+        }
+
+        key_value operator [] (size_type i) const noexcept { return begin()[i]; }
+
+        size_type size() const noexcept { return static_cast<size_type>(m_last - m_first); }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return m_first == m_last; }
+
+    private:
+        friend class environment;
+        friend class snapshot;
+
+        // set when the view came from environment::with_prefix, keeps the entries alive
+        std::shared_ptr<const snapshot> m_owner;
+        // the run merged with the thread's overrides, when an overlay was active
+        std::shared_ptr<const void> m_merged;
+        detail::snapshot_entry const* m_first = nullptr;
+        detail::snapshot_entry const* m_last = nullptr;
+        char const* m_strings = nullptr;
+        std::size_t m_skip = 0;
+    };
+
+    static_assert(ranges::random_access_range<environment::prefix_view>);
+
+
+    // a template with references to variables, parsed once and expanded against any snapshot.
+    //
+    //   $VAR and ${VAR}     the value of VAR, empty if it's not set
+    //   ${VAR:-default}     the value of VAR, or 'default' if it's not set or empty
+    //   \$                  a literal '$', so is a '$' that doesn't start a reference
+    //
+    // names after a bare '$' are letters, digits and '_', not starting with a digit. defaults are literal and can't contain '}'.
+    class environment::expansion
+    {
+    public:
+        // throws std::invalid_argument on an unterminated or empty ${}
+        explicit expansion(std::string_view text);
+
+        // the result's size is computed first, so it's allocated once
+        std::string expand(snapshot const& snap) const;
+
+        template<class OutputIt>
+        OutputIt expand(snapshot const& snap, OutputIt out) const
+        {
+            for (auto const& p : m_pieces) {
+                auto const s = resolve(snap, p);
+                out = std::copy(s.begin(), s.end(), out);
+            }
+            return out;
+        }
+
+    private:
+        // a literal or a variable reference, offsets are into m_text
+        struct piece
+        {
+            std::uint32_t offset;
+            std::uint32_t length;
+            std::uint32_t fallback_offset;
+            std::uint32_t fallback_length;
+            bool variable;
+        };
+
+        std::string_view resolve(snapshot const& snap, piece const& p) const noexcept
+        {
+            std::string_view const text{m_text};
+            if (!p.variable)
+                return text.substr(p.offset, p.length);
+
+            auto const value = snap[text.substr(p.offset, p.length)];
+            return value.empty() ? text.substr(p.fallback_offset, p.fallback_length) : value;
+        }
+
+        std::string m_text;
+        std::vector<piece> m_pieces;
+    };
+
+    template<class OutputIt>
+    OutputIt environment::expand(std::string_view text, OutputIt out) const {
+        // 'text' isn't copied or split into pieces, the output is written as it's parsed
+        auto const snap = snapshot::current();
+        do_expand(text, *snap, [](void* it, std::string_view s) {
+            auto& out = *static_cast<OutputIt*>(it);
+            out = std::copy(s.begin(), s.end(), out);
+        }, &out);
+        return out;
+    }
+
+
+    // overrides variables for the current thread only, the process environment is left untouched.
+    // overlays stack and the innermost one wins. while one is active, environment's lookups and
+    // iteration see through it, and changes made through environment go to it.
+    class environment::overlay
+    {
+    public:
+        overlay();
+        ~overlay();
+
+        overlay(overlay const&) = delete;
+        overlay& operator=(overlay const&) = delete;
+
+        overlay& set(std::string_view key, std::string_view value);
+        overlay& erase(std::string_view key);
+
+    private:
+        friend class environment;
+
+        struct entry
+        {
+            std::string key;
+            std::basic_string<detail::envchar> line; // "key=value", unused if erased
+            bool erased;
+        };
+
+        // the entry overriding 'key' here or in an overlay below, nullptr if there's none
+        entry const* lookup(std::string_view key) const;
+        entry& upsert(std::string_view key);
+
+        // the process' block merged with the overrides, rebuilt when either changes
+        detail::envblock block();
+
+        overlay* m_parent;
+        std::vector<entry> m_entries;
+        std::vector<detail::envchar*> m_block;
+        std::uint64_t m_generation = 0;
+        std::uint64_t m_changes = 0;
+    };
+
+
+    // stages sets and erasures, then applies them all at once. readers going through the
+    // library see either the old or the new environment, never a mix.
+    class environment::transaction
+    {
+    public:
+        transaction& set(std::string_view key, std::string_view value) {
+            m_changes.set(key, value);
+            return *this;
+        }
+        transaction& erase(std::string_view key) {
+            m_changes.erase(key);
+            return *this;
+        }
+
+        // stages the variables of a .env file: KEY=value lines with an optional 'export ' and
+        // # comments. 'single quoted' values are literal, "double quoted" ones understand
+        // \n \t \r \\ \" \$ and both can span lines. nothing is staged if a line is malformed,
+        // std::invalid_argument tells which one.
+        transaction& parse_dotenv(std::string_view text);
+
+        // maps the file at 'path' and parses it
+        transaction& load_dotenv(std::filesystem::path const& path);
+
+        // applies the staged changes and clears them, or applies them to the active overlay if there's one
+        void commit();
+
+        void clear() noexcept { m_changes.clear(); }
+
+        [[nodiscard]]
+        bool empty() const noexcept { return m_changes.empty(); }
+
+    private:
+        detail::staged_changes m_changes;
+    };
+
+
+    // builds a null terminated block of "key=value" strings, e.g. the envp of a child process,
+    // from the current environment with some changes. the strings and the pointers live in two
+    // buffers that are reused by later builds.
+    class environment::envp_builder
+    {
+    public:
+        using iterator = ranges::basic_iterator<detail::view_cursor<char>>;
+
+        envp_builder& set(std::string_view key, std::string_view value) {
+            m_changes.set(key, value);
+            return *this;
+        }
+        envp_builder& erase(std::string_view key) {
+            m_changes.erase(key);
+            return *this;
+        }
+
+        // drops the staged changes, the buffers are kept
+        void clear() noexcept { m_changes.clear(); }
+
+        // builds the block, valid until the next build
+        char** build();
+
+        // the last block built, empty if there's none
+        char** data() noexcept { return m_pointers.data(); }
+
+        iterator begin() const noexcept {
+            return iterator(detail::view_cursor<char>(const_cast<char**>(m_pointers.data())));
+        }
+        auto end() const noexcept {
+            return ranges::default_sentinel;
+        }
+
+    private:
+        detail::staged_changes m_changes;
+        std::vector<char> m_strings;
+        std::vector<char*> m_pointers{nullptr};
+    };
+
+
     class arguments
     {
     public:
@@ -177,7 +1130,7 @@ namespace detail {
         arguments();
 
         value_type operator [] (index_type i) const noexcept {
-            return argv()[i];
+            return value_type(argv()[i], lengths()[i]);
         }
 
         value_type at(index_type i) const {
@@ -217,8 +1170,12 @@ namespace detail {
         [[nodiscard]] 
         int argc() const noexcept;
 
-        // only needed on posix systems if we can't auto-magically init
+        // only needed on posix systems if we can't auto-magically init.
+        // the arguments are set once, calls after that are ignored
         static void init(int argc, const char** argv) noexcept;
+
+    private:
+        std::size_t const* lengths() const noexcept;
     };
 
     static_assert(ranges::random_access_range<arguments>);
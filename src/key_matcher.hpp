@@ -0,0 +1,135 @@
+#pragma once
+
+// key_matcher.hpp - the matcher behind the environment's lookups. private to the library,
+// the tests and benchmarks include it from src/
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <type_traits>
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   include <emmintrin.h>
+#endif
+
+namespace red::session::detail
+{
+#if defined(__AVX2__)
+    inline constexpr std::size_t match_chunk = 32;
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    inline constexpr std::size_t match_chunk = 16;
+#else
+    inline constexpr std::size_t match_chunk = 1;
+#endif
+
+    // chunks can read past an entry's null, but never past its page. fine for the cpu, not for asan
+#if defined(__GNUC__) || defined(__clang__)
+#   define SESSIONS_NO_ASAN __attribute__((no_sanitize_address))
+#elif defined(_MSC_VER)
+#   define SESSIONS_NO_ASAN __declspec(no_sanitize_address)
+#else
+#   define SESSIONS_NO_ASAN
+#endif
+
+    // tells if an entry is "key=...", testing the key and the '=' in one pass without measuring
+    // the entry first. the pattern is padded so it loads whole, and entries are loaded in chunks
+    // only when they don't cross into the next page, past that it goes char by char.
+    template<class Ch>
+    class basic_key_matcher
+    {
+    public:
+        // 'pattern' is the key in the entries' encoding
+        basic_key_matcher(std::basic_string_view<Ch> pattern, bool ignore_case) : m_icase(ignore_case)
+        {
+            m_length = pattern.size() + 1;
+            auto const padded = (m_length + match_chunk - 1) / match_chunk * match_chunk;
+            Ch* buffer = m_inline;
+            if (padded > std::size(m_inline)) {
+                m_heap = std::make_unique<Ch[]>(padded);
+                buffer = m_heap.get();
+            }
+
+            std::fill(buffer, buffer + padded, Ch(0));
+            for (std::size_t i = 0; i < pattern.size(); i++)
+                buffer[i] = m_icase ? fold(pattern[i]) : pattern[i];
+            buffer[pattern.size()] = '=';
+            m_pattern = buffer;
+        }
+
+        basic_key_matcher(basic_key_matcher const&) = delete;
+        basic_key_matcher& operator=(basic_key_matcher const&) = delete;
+
+        bool operator() (Ch const* entry) const noexcept
+        {
+            std::size_t i = 0;
+            if constexpr (std::is_same_v<Ch, char> && match_chunk > 1)
+            {
+                for (; i < m_length; i += match_chunk)
+                {
+                    // a chunk that would cross a page boundary could fault
+                    if ((reinterpret_cast<std::uintptr_t>(entry + i) & 4095) > 4096 - match_chunk)
+                        break;
+
+                    auto const remaining = m_length - i;
+                    if (!chunk_matches(entry + i, m_pattern + i, remaining < match_chunk ? remaining : match_chunk))
+                        return false;
+                }
+            }
+
+            // a shorter entry stops at its null, which never matches the pattern
+            for (; i < m_length; i++) {
+                Ch const c = m_icase ? fold(entry[i]) : entry[i];
+                if (c != m_pattern[i])
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        static Ch fold(Ch c) noexcept {
+            return c >= 'A' && c <= 'Z' ? Ch(c + ('a' - 'A')) : c;
+        }
+
+        // compares the first 'count' chars of a chunk
+        SESSIONS_NO_ASAN
+        bool chunk_matches(char const* entry, char const* pattern, std::size_t count) const noexcept
+        {
+#if defined(__AVX2__)
+            auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(entry));
+            if (m_icase) {
+                auto const upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                                    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+                v = _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+            }
+            auto const p = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(pattern));
+            auto const equal = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, p)));
+            auto const wanted = count == 32 ? ~std::uint32_t(0) : (std::uint32_t(1) << count) - 1;
+            return (equal & wanted) == wanted;
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+            auto v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(entry));
+            if (m_icase) {
+                auto const upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                                 _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+                v = _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+            }
+            auto const p = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pattern));
+            auto const equal = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, p)));
+            auto const wanted = (std::uint32_t(1) << count) - 1;
+            return (equal & wanted) == wanted;
+#else
+            return std::char_traits<char>::compare(entry, pattern, count) == 0;
+#endif
+        }
+
+        Ch m_inline[128];
+        std::unique_ptr<Ch[]> m_heap;
+        Ch const* m_pattern = nullptr;
+        std::size_t m_length = 0;
+        bool m_icase = false;
+    };
+
+} // namespace red::session::detail
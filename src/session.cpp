@@ -4,16 +4,34 @@
 #   include <shellapi.h>
 #elif defined(__unix__)
 #   include <unistd.h>
+#   include <spawn.h>
+#   include <sys/wait.h>
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
 #   include <fstream>
 #   include <memory>
+#   include <bit>
 #endif
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
 #include <locale>
 #include <system_error>
 #include <cstdlib>
+#include <cerrno>
+#include <cstring>
 #include <cassert>
+#include <fstream>
 #include <range/v3/algorithm.hpp>
 #include "red/sessions/session.hpp"
+#include "red/sessions/process.hpp"
+#include "red/sessions/options.hpp"
+#include "key_matcher.hpp"
 
 using std::string; using std::wstring;
 using std::string_view; using std::wstring_view;
@@ -28,41 +46,70 @@ namespace sys {
     std::string getenv(std::string_view key);
     void setenv(std::string_view key, std::string_view value);
     void rmenv(std::string_view key);
+
+    // string in the platform's encoding
+    std::basic_string<envchar> envstr(std::string_view s);
+
+    // makes 'block' the environment, only where the library can own it
+    void set_envp(envblock block) noexcept;
+
+    // bumped on every change made through this layer
+    std::uint64_t generation() noexcept;
+    void touch() noexcept;
+
+    // maps a whole file read only, 'size' gets its size
+    std::shared_ptr<const std::byte[]> map_file(std::filesystem::path const& path, std::size_t& size);
     
 } // namespace sys
 
 // helpers
 namespace {
 
-template<class S>
-concept strview_members = requires(S s) { s.data(); s.size(); };
+using red::session::detail::basic_key_matcher;
 
-template<typename Traits>
-struct envstr_finder
+// readers of the block share this lock, changes made through the library take it exclusively
+std::shared_mutex env_mutex;
+
+// argv, the length of every argument and the storage they live in, when we own it
+struct argument_table
 {
-    using char_type = typename Traits::char_type;
-    using StrView = std::basic_string_view<char_type, Traits>;    
-    StrView key;
+    std::unique_ptr<char[]> strings;
+    std::vector<const char*> argv;
+    std::vector<std::size_t> lengths;
 
-    explicit envstr_finder(StrView k) : key(k) {}
+    constexpr argument_table() = default;
 
-    template<class T>
-        requires (!std::convertible_to<T, StrView> && strview_members<T>)
-    explicit envstr_finder(const T& k) : key(k.data(), k.size())
-    {}
+    // 'args' are owned by someone else
+    argument_table(int count, const char** args)
+    {
+        argv.reserve(count + 1);
+        lengths.reserve(count);
+        for (int i = 0; i < count; i++) {
+            argv.push_back(args[i]);
+            lengths.push_back(std::strlen(args[i]));
+        }
+        argv.push_back(nullptr);
+    }
 
-    bool operator() (StrView entry) noexcept
+    // takes 'size' bytes of null terminated arguments, empty ones included
+    argument_table(std::unique_ptr<char[]> buffer, std::size_t size) : strings(std::move(buffer))
     {
-        return
-            entry.length() > key.length() &&
-            entry[key.length()] == '=' &&
-            entry.compare(0, key.length(), key) == 0;
+        auto const first = strings.get(), last = first + size;
+        auto const count = std::count(first, last, '\0');
+
+        argv.reserve(count + 1);
+        lengths.reserve(count);
+        for (auto arg = first; arg != last; ) {
+            auto const length = std::strlen(arg);
+            argv.push_back(arg);
+            lengths.push_back(length);
+            arg += length + 1;
+        }
+        argv.push_back(nullptr);
     }
 
-    template<class T>
-        requires (!std::convertible_to<T, StrView> && strview_members<T>)
-    bool operator() (const T& v) noexcept {
-        return this->operator()(StrView(v.data(), v.size()));
+    int argc() const noexcept {
+        return static_cast<int>(lengths.size());
     }
 };
 
@@ -111,7 +158,14 @@ struct ci_char_traits : public std::char_traits<char> {
     }
 };
 
-using envfind_fn = envstr_finder<ci_char_traits>;
+using envkey_traits = ci_char_traits;
+
+// _wputenv_s with an empty value removes the variable
+constexpr bool empty_value_erases = true;
+
+// the CRT owns _wenviron, changes must go through _wputenv_s
+constexpr bool can_set_envp = false;
+constexpr bool owned_storage = false;
 
 namespace {
 
@@ -163,7 +217,7 @@ namespace {
         return convert_str<wchar_t>(nstr);
     }
 
-    auto init_args() {
+    argument_table init_args() {
         int argc;
         auto wargv = std::unique_ptr<LPWSTR[], decltype(LocalFree)*>{
             CommandLineToArgvW(GetCommandLineW(), &argc),
@@ -172,37 +226,35 @@ namespace {
 
         if (!wargv)
             throw_win_error();
-        
-        std::vector<char const*> vec;
 
         try
         {
-            vec.resize(argc+1, nullptr); // +1 for terminating null
-
-            std::transform(wargv.get(), wargv.get()+argc, vec.begin(), [](const wchar_t* arg) {
-                auto length = narrow(arg);
-                auto* ptr = new char[length];
-                auto result = narrow(arg, -1, ptr, length);
-                if (result==0) {
-                    delete[] ptr;
+            // lengths include the terminating null
+            std::size_t size = 0;
+            for (int i = 0; i < argc; i++)
+                size += narrow(wargv[i]);
+
+            auto buffer = std::make_unique<char[]>(size);
+            auto ptr = buffer.get();
+            for (int i = 0; i < argc; i++) {
+                auto length = narrow(wargv[i], -1, ptr, static_cast<int>(buffer.get() + size - ptr));
+                if (length == 0)
                     throw_win_error();
-                }
-                
-                return ptr;
-            });
 
-            return vec;
+                ptr += length;
+            }
+
+            return argument_table(std::move(buffer), size);
         }
         catch (std::exception&)
         {
-            for (auto p : vec) delete[] p;
             std::throw_with_nested(std::runtime_error("Failed to create arguments"));
         }
     }
 
     auto& argvec() {
-        static auto vec = init_args();
-        return vec;
+        static auto table = init_args();
+        return table;
     }
 
 } // unnamed namespace
@@ -224,12 +276,88 @@ void sys::setenv(string_view key, string_view value) {
     auto wkey = to_wide(key);
     auto wvalue = to_wide(value);
     _wputenv_s(wkey.c_str(), wvalue.c_str());
+    sys::touch();
+}
+std::wstring sys::envstr(string_view s) {
+    return to_wide(s);
 }
 void sys::rmenv(string_view k) {
     auto wkey = to_wide(k);
     _wputenv_s(wkey.c_str(), L"");
+    sys::touch();
+}
+
+std::shared_ptr<const std::byte[]> sys::map_file(std::filesystem::path const& path, std::size_t& size)
+{
+    auto file = std::unique_ptr<void, decltype(CloseHandle)*>{
+        CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr),
+        CloseHandle
+    };
+    if (file.get() == INVALID_HANDLE_VALUE) {
+        file.release();
+        throw_win_error();
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file.get(), &file_size))
+        throw_win_error();
+    size = static_cast<std::size_t>(file_size.QuadPart);
+    if (size == 0)
+        return nullptr;
+
+    auto mapping = std::unique_ptr<void, decltype(CloseHandle)*>{
+        CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr),
+        CloseHandle
+    };
+    if (!mapping)
+        throw_win_error();
+
+    auto view = MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+        throw_win_error();
+
+    // the view keeps the mapping alive after its handles are closed
+    return std::shared_ptr<const std::byte[]>(static_cast<std::byte const*>(view), [](std::byte const* p) {
+        UnmapViewOfFile(p);
+    });
 }
 
+namespace {
+
+    // quotes 'arg' the way CommandLineToArgvW reads it back
+    void append_quoted(wstring& cmdline, wstring_view arg)
+    {
+        if (!arg.empty() && arg.find_first_of(L" \t\n\v\"") == wstring_view::npos) {
+            cmdline += arg;
+            return;
+        }
+
+        cmdline += L'"';
+        for (auto it = arg.begin(); ; ++it)
+        {
+            std::size_t backslashes = 0;
+            while (it != arg.end() && *it == L'\\') {
+                ++it;
+                ++backslashes;
+            }
+
+            if (it == arg.end()) {
+                cmdline.append(backslashes * 2, L'\\');
+                break;
+            }
+            else if (*it == L'"') {
+                cmdline.append(backslashes * 2 + 1, L'\\');
+            }
+            else {
+                cmdline.append(backslashes, L'\\');
+            }
+            cmdline += *it;
+        }
+        cmdline += L'"';
+    }
+
+} // unnamed namespace
+
 namespace red::session {
 
 string detail::narrow_copy(envchar const* s) {
@@ -237,11 +365,15 @@ string detail::narrow_copy(envchar const* s) {
 }
 
 const char** arguments::argv() const noexcept {
-    return argvec().data();
+    return argvec().argv.data();
 }
 
 int arguments::argc() const noexcept {
-    return static_cast<int>(argvec().size()) - 1;
+    return argvec().argc();
+}
+
+std::size_t const* arguments::lengths() const noexcept {
+    return argvec().lengths.data();
 }
 
 void arguments::init(int, const char**) noexcept {
@@ -250,6 +382,67 @@ void arguments::init(int, const char**) noexcept {
 
 const char environment::path_separator = ';';
 
+child detail::spawn(char const* const* argv, char const* const* envp)
+{
+    if (!argv || !argv[0])
+        throw std::invalid_argument("spawn needs a program to start");
+
+    wstring cmdline;
+    for (auto arg = argv; *arg; arg++) {
+        if (arg != argv)
+            cmdline += L' ';
+        append_quoted(cmdline, to_wide(*arg));
+    }
+
+    // "key=value\0...\0", the effective block if there's no envp so overlays are seen
+    wstring block;
+    if (envp) {
+        for (auto entry = envp; *entry; entry++) {
+            block += to_wide(*entry);
+            block += L'\0';
+        }
+    }
+    else {
+        std::shared_lock lock{env_mutex};
+        for (auto entry = environment::effective_block(); entry && *entry; entry++) {
+            block += *entry;
+            block += L'\0';
+        }
+    }
+    block.append(block.empty() ? 2 : 1, L'\0');
+
+    STARTUPINFOW startup{};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION info{};
+
+    if (!CreateProcessW(nullptr, cmdline.data(), nullptr, nullptr, FALSE, CREATE_UNICODE_ENVIRONMENT,
+                        block.data(), nullptr, &startup, &info))
+        throw_win_error();
+
+    CloseHandle(info.hThread);
+    return child(info.hProcess);
+}
+
+child::~child()
+{
+    if (m_handle)
+        CloseHandle(m_handle);
+}
+
+int child::wait()
+{
+    if (!valid())
+        throw std::system_error(std::make_error_code(std::errc::no_child_process), "child::wait");
+
+    DWORD code = 0;
+    if (WaitForSingleObject(m_handle, INFINITE) == WAIT_FAILED || !GetExitCodeProcess(m_handle, &code))
+        throw_win_error();
+
+    // waited for once, like on posix
+    CloseHandle(std::exchange(m_handle, nullptr));
+    return static_cast<int>(code);
+}
+
 environment::environment() noexcept
 {
     if (!_wenviron)
@@ -262,36 +455,285 @@ environment::environment() noexcept
 
 extern "C" char** environ;
 
-static std::vector<const char*> myargs;
+// constant initialized, so they're ready before sessions_autorun runs
+static constinit argument_table myargs, no_args;
+
+// points to no_args until the arguments are set, and to myargs after that
+static constinit std::atomic<argument_table const*> published_args{&no_args};
+static constinit std::mutex args_mutex;
 
 #if !defined(SESSIONS_NOEXTENTIONS)
 [[gnu::constructor]]
 // must have external linkage
 void sessions_autorun(int count, const char** args) {
-    myargs.reserve(count);
-    std::copy(args, args+count, back_inserter(myargs));
-    myargs.push_back(nullptr);
+    myargs = argument_table(count, args);
+    published_args.store(&myargs, std::memory_order_release);
 }
 #endif
 
-using envfind_fn = envstr_finder<std::char_traits<char>>;
+namespace {
+
+    argument_table const& args_table() noexcept {
+        return *published_args.load(std::memory_order_acquire);
+    }
+
+    // sets the arguments once, the first caller wins
+    template<class Fn>
+    void publish_args(Fn&& make)
+    {
+        std::lock_guard lock{args_mutex};
+        if (published_args.load(std::memory_order_relaxed) == &no_args) {
+            myargs = make();
+            published_args.store(&myargs, std::memory_order_release);
+        }
+    }
+
+} // unnamed namespace
+
+#if HAS_PROCFS
+namespace {
+
+    // procfs files have no size, read until EOF into one buffer
+    argument_table read_cmdline()
+    {
+        int fd = ::open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return {};
+
+        std::size_t size = 0, capacity = 64 * 1024;
+        auto buffer = std::make_unique<char[]>(capacity);
+
+        for (;;)
+        {
+            auto const count = ::read(fd, buffer.get() + size, capacity - size);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                break;
+
+            // always keep room for a terminating null
+            size += count;
+            if (size == capacity) {
+                auto bigger = std::make_unique<char[]>(capacity *= 2);
+                std::memcpy(bigger.get(), buffer.get(), size);
+                buffer = std::move(bigger);
+            }
+        }
+        ::close(fd);
+
+        // a process can overwrite its arguments and drop the last null
+        if (size != 0 && buffer[size - 1] != '\0')
+            buffer[size++] = '\0';
+
+        return argument_table(std::move(buffer), size);
+    }
+
+} // unnamed namespace
+#endif
+
+using envkey_traits = std::char_traits<char>;
+
+constexpr bool empty_value_erases = false;
+constexpr bool can_set_envp = true;
+
+#if defined(SESSIONS_OWNED_STORAGE)
+constexpr bool owned_storage = true;
+#else
+constexpr bool owned_storage = false;
+#endif
 
 sys::envblock sys::envp() noexcept {
     return environ;
 }
+void sys::set_envp(envblock block) noexcept {
+    environ = block;
+}
+
+// libc wants null terminated strings, short ones are copied on the stack
+using red::session::detail::small_string;
+
+#if defined(SESSIONS_OWNED_STORAGE)
+namespace {
+
+    // setenv never frees the strings it replaces. here the library owns the block and the
+    // strings it sets instead: each key keeps one string, rewritten in place while the new
+    // entry fits, so memory stays bounded however often a variable changes.
+    // pointers from ::getenv are good until that variable changes, as posix allows.
+    // callers hold env_mutex exclusively.
+    class owned_environment
+    {
+    public:
+        void set(string_view key, string_view value)
+        {
+            adopt();
+            auto it = m_slots.find(key);
+            if (it == m_slots.end())
+                it = m_slots.emplace(key, slot{}).first;
+
+            auto& s = it->second;
+            auto const pos = position(s, key);
+            auto const size = key.size() + value.size() + 2;
+
+            std::unique_ptr<char[]> old;
+            if (size > s.capacity) {
+                // grow by powers of 2, so a variable that keeps changing settles on one size
+                s.capacity = std::bit_ceil(std::max<std::size_t>(size, 32));
+                old = std::exchange(s.line, std::make_unique<char[]>(s.capacity));
+            }
+
+            // 'old' is freed once the block doesn't point to it
+            write(s.line.get(), key, value);
+            publish(s, pos);
+        }
+
+        void erase(string_view key)
+        {
+            adopt();
+            basic_key_matcher<char> const matches(key, false);
+            // duplicates go too, like unsetenv
+            m_block.erase(std::remove_if(m_block.begin(), m_block.end() - 1, [&](char* e) { return matches(e); }),
+                          m_block.end() - 1);
+            environ = m_block.data();
+
+            if (auto it = m_slots.find(key); it != m_slots.end())
+                m_slots.erase(it);
+        }
+
+    private:
+        struct slot
+        {
+            std::unique_ptr<char[]> line;
+            std::size_t capacity = 0;
+            // where 'line' was last published
+            std::size_t pos = 0;
+        };
+
+        struct key_hash
+        {
+            using is_transparent = void;
+            std::size_t operator() (string_view k) const noexcept { return std::hash<string_view>{}(k); }
+        };
+
+        // makes 'm_block' the environment. anyone else's block is copied first
+        void adopt()
+        {
+            if (environ != m_block.data()) {
+                m_block.clear();
+                for (auto e = environ; e && *e; e++)
+                    m_block.push_back(*e);
+                m_block.push_back(nullptr);
+                environ = m_block.data();
+            }
+
+            // unsetenv moves the entries of whatever block it finds, leaving extra nulls at the end
+            while (m_block.size() > 1 && !m_block[m_block.size() - 2])
+                m_block.pop_back();
+        }
+
+        // where the entry for 'key' is, the end if it's not there
+        std::size_t position(slot const& s, string_view key) const
+        {
+            auto const end = m_block.size() - 1;
+            if (s.line && s.pos < end && m_block[s.pos] == s.line.get())
+                return s.pos;
+
+            basic_key_matcher<char> const matches(key, false);
+            for (std::size_t i = 0; i < end; i++) {
+                if (matches(m_block[i]))
+                    return i;
+            }
+            return end;
+        }
+
+        static void write(char* line, string_view key, string_view value) noexcept
+        {
+            key.copy(line, key.size());
+            line[key.size()] = '=';
+            value.copy(line + key.size() + 1, value.size());
+            line[key.size() + value.size() + 1] = '\0';
+        }
+
+        void publish(slot& s, std::size_t pos)
+        {
+            if (pos == m_block.size() - 1)
+                m_block.insert(m_block.end() - 1, s.line.get());
+            else
+                m_block[pos] = s.line.get();
+
+            s.pos = pos;
+            environ = m_block.data();
+        }
+
+        std::vector<char*> m_block{nullptr};
+        std::unordered_map<string, slot, key_hash, std::equal_to<>> m_slots;
+    };
+
+    // never destroyed, environ points into it until the process is gone
+    owned_environment& owned()
+    {
+        static auto& instance = *new owned_environment;
+        return instance;
+    }
+
+} // unnamed namespace
+#endif
 
 string sys::getenv(string_view k) {
-    string key{k};
+    small_string key{k};
     char* val = ::getenv(key.c_str());
     return val ? val : "";
 }
 void sys::setenv(string_view k, string_view v) {
-    string key{k}, value{v};
+#if defined(SESSIONS_OWNED_STORAGE)
+    owned().set(k, v);
+#else
+    small_string key{k}, value{v};
     ::setenv(key.c_str(), value.c_str(), true);
+#endif
+    sys::touch();
+}
+std::string sys::envstr(string_view s) {
+    return string(s);
 }
 void sys::rmenv(string_view k) {
-    string key{k};
+#if defined(SESSIONS_OWNED_STORAGE)
+    owned().erase(k);
+#else
+    small_string key{k};
     ::unsetenv(key.c_str());
+#endif
+    sys::touch();
+}
+
+std::shared_ptr<const std::byte[]> sys::map_file(std::filesystem::path const& path, std::size_t& size)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), path.string());
+
+    struct stat info;
+    if (::fstat(fd, &info) == -1) {
+        auto const error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), path.string());
+    }
+
+    size = static_cast<std::size_t>(info.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    // shared, so every process mapping the file uses the same pages
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    auto const error = errno;
+    ::close(fd);
+    if (data == MAP_FAILED)
+        throw std::system_error(error, std::generic_category(), path.string());
+
+    return std::shared_ptr<const std::byte[]>(static_cast<std::byte const*>(data), [size](std::byte const* p) {
+        ::munmap(const_cast<std::byte*>(p), size);
+    });
 }
 
 namespace red::session {
@@ -302,56 +744,110 @@ string detail::narrow_copy(envchar const* s) {
 
 arguments::arguments() {
 #if HAS_PROCFS
-    if (myargs.empty()) {
-        std::ifstream proc{"/proc/self/cmdline"};
-
-        if (proc.fail()) {
-            return;
-        }
-
-        while (proc.good()) {
-            string value;
-            getline(proc, value, char(0));
-
-            if (value.empty())
-                continue;
-
-            auto bababooye = std::make_unique<char[]>(value.length()+1);
-            value.copy(bababooye.get(), value.length());
-
-            myargs.push_back(bababooye.release());
-        }
-
-        myargs.push_back(nullptr);
+    if (&args_table() == &no_args) {
+        publish_args(read_cmdline);
     }
 
 #elif !defined(SESSIONS_NOEXTENTIONS)
-    assert(!myargs.empty() && "somehow 'myargs' is not initialized");
+    assert(&args_table() != &no_args && "somehow 'myargs' is not initialized");
 #endif
 }
 
 const char** arguments::argv() const noexcept {
-    return myargs.data();
+    return const_cast<const char**>(args_table().argv.data());
 }
 
 int arguments::argc() const noexcept {
-    return (int)myargs.size() - 1;
+    return args_table().argc();
 }
 
+std::size_t const* arguments::lengths() const noexcept {
+    return args_table().lengths.data();
+}
 
 void arguments::init(int count, const char** args) noexcept
 {
-    if (!myargs.empty()) {
-        myargs.clear();
-    }
-    
-    myargs.reserve(count);
-    std::copy(args, args+count, back_inserter(myargs));
-    myargs.push_back(nullptr);
+    publish_args([=] { return argument_table(count, args); });
 }
 
 const char environment::path_separator = ':';
 
+namespace {
+
+    // children dropped before they exited, reaped when they do
+    std::mutex orphans_mutex;
+    std::vector<pid_t> orphans;
+
+    // true if 'pid' was reaped or is gone
+    bool try_reap(pid_t pid) noexcept
+    {
+        int status;
+        pid_t r;
+        while ((r = waitpid(pid, &status, WNOHANG)) == -1 && errno == EINTR) {}
+        return r != 0;
+    }
+
+    void reap_orphans() noexcept
+    {
+        std::lock_guard lock{orphans_mutex};
+        std::erase_if(orphans, try_reap);
+    }
+
+} // unnamed namespace
+
+child detail::spawn(char const* const* argv, char const* const* envp)
+{
+    if (!argv || !argv[0])
+        throw std::invalid_argument("spawn needs a program to start");
+
+    reap_orphans();
+
+    pid_t pid = 0;
+    int error = 0;
+    auto const args = const_cast<char* const*>(argv);
+
+    if (envp) {
+        error = posix_spawnp(&pid, argv[0], nullptr, nullptr, args, const_cast<char* const*>(envp));
+    }
+    else {
+        // the effective block, so overlays are seen like with an envp_builder
+        std::shared_lock lock{env_mutex};
+        error = posix_spawnp(&pid, argv[0], nullptr, nullptr, args, environment::effective_block());
+    }
+
+    if (error)
+        throw std::system_error(error, std::generic_category(), "posix_spawnp");
+
+    return child(pid);
+}
+
+child::~child()
+{
+    if (!valid() || try_reap(m_handle))
+        return;
+
+    // still running, a later spawn or destructor reaps it
+    std::lock_guard lock{orphans_mutex};
+    orphans.push_back(m_handle);
+}
+
+int child::wait()
+{
+    // waitpid(0) would reap any child of the group
+    if (!valid())
+        throw std::system_error(std::make_error_code(std::errc::no_child_process), "child::wait");
+
+    int status = 0;
+    while (waitpid(m_handle, &status, 0) == -1) {
+        if (errno != EINTR)
+            throw std::system_error(errno, std::generic_category(), "waitpid");
+    }
+
+    // the pid may be reused once it's reaped
+    m_handle = 0;
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
 environment::environment() noexcept = default;
 
 } // namespace red::session
@@ -360,37 +856,1485 @@ environment::environment() noexcept = default;
 #endif
 
 // common
-namespace red::session {
+namespace {
 
-std::string red::session::environment::variable::value() const
+using red::session::detail::snapshot_entry;
+using red::session::detail::snapshot_slot;
+using envkey_view = std::basic_string_view<char, envkey_traits>;
+
+constexpr bool envkey_icase = !std::is_same_v<envkey_traits, std::char_traits<char>>;
+
+using key_matcher = basic_key_matcher<red::session::detail::envchar>;
+
+envkey_view as_key(string_view k) noexcept {
+    return { k.data(), k.size() };
+}
+
+// FNV-1a, folded to upper case when keys are case insensitive
+std::uint32_t envkey_hash(string_view key) noexcept
 {
-    return sys::getenv(m_key);
+    std::uint32_t hash = 2166136261u;
+    for (unsigned char c : key) {
+        if (envkey_icase && c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
 }
 
-auto environment::variable::operator= (string_view value) -> variable&
+string_view entry_key(string_view line) noexcept
 {
-    sys::setenv(m_key, value);
-    return *this;
+    // skip the first char, windows has hidden entries like "=C:=C:\"
+    return line.substr(0, line.find('=', 1));
 }
 
-auto environment::begin_cursor() const -> cursor
+// walks the index starting at 'hash', stops at the slot holding 'key' or at the first empty one
+template<class Slot>
+Slot* probe_index(Slot* index, std::uint32_t mask, snapshot_entry const* entries, char const* strings,
+                  string_view key, std::uint32_t hash) noexcept
 {
-    return cursor(sys::envp());
+    auto i = hash & mask;
+    while (index[i].entry != 0)
+    {
+        if (index[i].hash == hash) {
+            auto const& e = entries[index[i].entry - 1];
+            if (as_key(key) == as_key({strings + e.offset, e.keylen}))
+                break;
+        }
+        i = (i + 1) & mask;
+    }
+    return index + i;
 }
 
-auto environment::do_find(string_view k) const ->iterator
+// an entry as the library sees it, a view on posix and a narrowed copy on windows
+template<class Ch>
+auto read_entry(Ch const* entry)
 {
-    return ranges::find_if(*this, envfind_fn(k));
+    if constexpr (std::is_same_v<Ch, char>)
+        return string_view(entry);
+    else
+        return red::session::detail::narrow_copy(entry);
 }
 
-bool environment::contains(string_view k) const
+std::atomic<std::uint64_t> env_generation{0};
+
+// per thread index of 'key -> slot in the environment block', dropped whenever the block
+// moves or the generation changes. hits are checked against the slot so values replaced
+// behind our back are still seen, variables added behind our back need environment::touch()
+class lookup_cache
+{
+public:
+    // slot holding 'key' in the current block, nullptr if not found
+    sys::envblock find(string_view key);
+
+private:
+    struct key_hash
+    {
+        using is_transparent = void;
+        std::size_t operator() (string_view k) const noexcept { return envkey_hash(k); }
+    };
+    struct key_equal
+    {
+        using is_transparent = void;
+        bool operator() (string_view a, string_view b) const noexcept { return as_key(a) == as_key(b); }
+    };
+
+    static constexpr auto npos = std::size_t(-1);
+    static constexpr auto unknown = std::size_t(-2);
+    static constexpr std::size_t max_keys = 1024;
+
+    sys::envblock m_block = nullptr;
+    std::uint64_t m_generation = 0;
+    std::unordered_map<string, std::size_t, key_hash, key_equal> m_index;
+};
+
+sys::envblock lookup_cache::find(string_view key)
+{
+    auto const block = sys::envp();
+    auto const generation = sys::generation();
+    if (block != m_block || generation != m_generation) {
+        // keep the keys so they aren't allocated again, only their slots are stale
+        if (m_index.size() > max_keys)
+            m_index.clear();
+        for (auto& entry : m_index)
+            entry.second = unknown;
+
+        m_block = block;
+        m_generation = generation;
+    }
+
+    if (!block)
+        return nullptr;
+
+#if defined(WIN32)
+    auto const matches = key_matcher(sys::envstr(key), envkey_icase);
+#else
+    auto const matches = key_matcher(key, envkey_icase);
+#endif
+    auto it = m_index.find(key);
+    if (it != m_index.end() && it->second != unknown)
+    {
+        auto const pos = it->second;
+        if (pos == npos)
+            return nullptr;
+        if (block[pos] && matches(block[pos]))
+            return block + pos;
+    }
+
+    auto pos = npos;
+    for (std::size_t i = 0; block[i]; i++) {
+        if (matches(block[i])) {
+            pos = i;
+            break;
+        }
+    }
+
+    if (it != m_index.end())
+        it->second = pos;
+    else
+        m_index.emplace(key, pos);
+
+    return pos != npos ? block + pos : nullptr;
+}
+
+lookup_cache& cache()
 {
-    return !sys::getenv(k).empty();
+    thread_local lookup_cache instance;
+    return instance;
 }
 
-void environment::do_erase(string_view k)
+// number of entries in the block, kept current by the library's own changes.
+// anything else is noticed through the block or the generation and recounted.
+struct entry_count
+{
+    sys::envblock block = nullptr;
+    std::uint64_t generation = 0;
+    std::size_t count = 0;
+} counted;
+
+// readers may refresh 'counted' while sharing env_mutex
+std::mutex count_mutex;
+
+// cheap, only walks the pointer array
+std::size_t count_entries(sys::envblock block) noexcept
+{
+    std::size_t n = 0;
+    if (block) {
+        while (block[n])
+            n++;
+    }
+    return n;
+}
+
+// applies 'change' through the system layer, moving the entry count by 'delta' if it was current
+template<class Fn>
+void change_entries(std::ptrdiff_t delta, Fn&& change)
+{
+    bool const current = counted.block == sys::envp() && counted.generation == sys::generation();
+    change();
+    if (current)
+        counted = { sys::envp(), sys::generation(), counted.count + delta };
+}
+
+using red::session::detail::staged_changes;
+
+// walks 'block' with the 'staged' changes applied. untouched entries go to 'keep', and the
+// changes that set a value go to 'add': in place of the entry they replace, or at the end.
+template<class Keep, class Add>
+void merge_changes(sys::envblock block, staged_changes& staged, Keep&& keep, Add&& add)
 {
-    sys::rmenv(k);
+    auto& changes = staged.resolve();
+    for (auto& c : changes)
+        c.matched = false;
+
+    for (; block && *block; block++)
+    {
+        auto const line = read_entry(*block);
+        auto const key = as_key(entry_key(line));
+        auto it = std::lower_bound(changes.begin(), changes.end(), key, [&](auto const& c, envkey_view k) {
+            return as_key(staged.key(c)) < k;
+        });
+        if (it == changes.end() || as_key(staged.key(*it)) != key) {
+            keep(*block);
+            continue;
+        }
+        // duplicated keys are all replaced by a single entry
+        if (!it->matched && !it->erase)
+            add(*it);
+        it->matched = true;
+    }
+
+    for (auto& c : changes) {
+        if (!c.matched && !c.erase)
+            add(c);
+    }
 }
 
-} // namespace red::session
\ No newline at end of file
+// the pointer block installed by the last commit, and the strings of every commit.
+// like setenv's, the strings are kept for good since later blocks may still point to them.
+sys::envblock committed_block = nullptr;
+
+// never destroyed, environ points into it until the process is gone
+std::vector<std::unique_ptr<char[]>>& committed_strings()
+{
+    static auto& strings = *new std::vector<std::unique_ptr<char[]>>;
+    return strings;
+}
+
+// applies 'staged' at once, callers hold env_mutex exclusively.
+// owned storage reuses its strings, so it takes the changes one by one
+template<bool SetEnvp = can_set_envp && !owned_storage>
+void commit_changes(staged_changes& staged)
+{
+    if constexpr (SetEnvp)
+    {
+        auto const base = sys::envp();
+        std::size_t strings_size = 0, sets = 0;
+        for (auto& c : staged.resolve()) {
+            if (!c.erase) {
+                strings_size += c.length + 1;
+                sets++;
+            }
+        }
+
+        // one allocation for the new strings, one for the pointers
+        auto strings = std::make_unique<char[]>(strings_size);
+        auto block = std::make_unique<char*[]>(count_entries(base) + sets + 1);
+        auto* next = strings.get();
+        std::size_t n = 0;
+
+        merge_changes(base, staged,
+            [&](char* entry) { block[n++] = entry; },
+            [&](staged_changes::change const& c) {
+                auto const line = staged.line(c);
+                line.copy(next, line.size());
+                block[n++] = next;
+                next += line.size() + 1;
+            });
+        block[n] = nullptr;
+
+        sys::set_envp(block.get());
+        delete[] committed_block;
+        committed_block = block.release();
+        committed_strings().push_back(std::move(strings));
+
+        sys::touch();
+        counted = { sys::envp(), sys::generation(), n };
+    }
+    else
+    {
+        for (auto& c : staged.resolve()) {
+            if (c.erase)
+                sys::rmenv(staged.key(c));
+            else
+                sys::setenv(staged.key(c), staged.value(c));
+        }
+    }
+}
+
+using red::session::environment;
+
+// the innermost overlay of this thread, and a counter of its changes
+thread_local environment::overlay* active_overlay = nullptr;
+thread_local std::uint64_t overlay_changes = 0;
+
+} // unnamed namespace
+
+std::uint64_t sys::generation() noexcept
+{
+    return env_generation.load(std::memory_order_acquire);
+}
+
+void sys::touch() noexcept
+{
+    env_generation.fetch_add(1, std::memory_order_acq_rel);
+}
+
+namespace red::session {
+
+template<class Fn>
+decltype(auto) environment::variable::visit(Fn&& fn) const
+{
+    if (active_overlay) {
+        if (auto* e = active_overlay->lookup(key())) {
+            if (e->erased)
+                return fn(string_view());
+
+            auto const line = read_entry(e->line.c_str());
+            return fn(string_view(line).substr(e->key.size() + 1));
+        }
+    }
+
+    std::shared_lock lock{env_mutex};
+    auto slot = cache().find(key());
+    if (!slot)
+        return fn(string_view());
+
+    auto const line = read_entry(*slot);
+    auto const eq = entry_key(line).size();
+    return fn(eq < line.size() ? string_view(line).substr(eq + 1) : string_view());
+}
+
+std::string red::session::environment::variable::value() const
+{
+    return visit([](string_view value) { return string(value); });
+}
+
+void environment::variable::read(void (*fn)(void*, string_view), void* context) const
+{
+    // missing variables come as a null view
+    visit([&](string_view value) {
+        if (value.data())
+            fn(context, value);
+    });
+}
+
+auto environment::variable::split(char sep) const -> split_view
+{
+    // copies straight from the entry into the view's buffer
+    return visit([sep](string_view value) { return split_view(value, sep); });
+}
+
+auto environment::variable::split(char sep, std::pmr::memory_resource* resource) const -> split_view
+{
+    return visit([=](string_view value) { return split_view(value, sep, resource); });
+}
+
+auto environment::variable::operator= (string_view value) -> variable&
+{
+    if (active_overlay) {
+        active_overlay->set(key(), value);
+        return *this;
+    }
+
+    std::unique_lock lock{env_mutex};
+    bool const existed = cache().find(key()) != nullptr;
+    bool const exists = !(empty_value_erases && value.empty());
+    change_entries(int(exists) - int(existed), [&]{ sys::setenv(key(), value); });
+    return *this;
+}
+
+auto environment::effective_block() -> detail::envblock
+{
+    return active_overlay ? active_overlay->block() : sys::envp();
+}
+
+bool environment::overlay_active() noexcept
+{
+    return active_overlay != nullptr;
+}
+
+auto environment::begin_cursor() const -> cursor
+{
+    if (!active_overlay)
+        return cursor(sys::envp());
+
+    std::shared_lock lock{env_mutex};
+    return cursor(active_overlay->block());
+}
+
+auto environment::do_find(string_view k) const ->iterator
+{
+    std::shared_lock lock{env_mutex};
+    if (!active_overlay) {
+        auto slot = cache().find(k);
+        return slot ? iterator(cursor(slot)) : ranges::next(begin(), end());
+    }
+
+    // the merged block holds the same entry pointers, look for the effective one
+    detail::envchar const* target = nullptr;
+    if (auto* e = active_overlay->lookup(k))
+        target = e->erased ? nullptr : e->line.c_str();
+    else if (auto slot = cache().find(k))
+        target = *slot;
+
+    auto block = active_overlay->block();
+    while (*block && *block != target)
+        block++;
+    return iterator(cursor(block));
+}
+
+bool environment::contains(string_view k) const
+{
+    // missing variables come as a null view, empty values don't
+    return variable(k).visit([](string_view value) { return value.data() != nullptr; });
+}
+
+auto environment::do_get_many(string_view const* keys, std::size_t count) -> value_list
+{
+    value_list result;
+    result.m_values.assign(count, {value_list::missing, 0});
+
+    // the requested keys, hashed once. duplicates point to the first request
+    std::size_t size = 8;
+    while (size < count * 2)
+        size *= 2;
+    auto const mask = size - 1;
+
+    std::vector<std::uint32_t> slots(size, 0);
+    std::vector<std::uint32_t> first(count);
+    std::vector<std::uint32_t> hashes(count);
+    // first chars of the keys, most entries are rejected without hashing
+    bool starts[256] = {};
+
+    auto probe = [&](string_view key, std::uint32_t hash) {
+        auto i = hash & mask;
+        while (slots[i] && (hashes[slots[i] - 1] != hash || as_key(keys[slots[i] - 1]) != as_key(key)))
+            i = (i + 1) & mask;
+        return &slots[i];
+    };
+
+    std::size_t unique = 0;
+    for (std::uint32_t k = 0; k < count; k++)
+    {
+        hashes[k] = envkey_hash(keys[k]);
+        auto slot = probe(keys[k], hashes[k]);
+        if (*slot) {
+            first[k] = *slot - 1;
+            continue;
+        }
+
+        *slot = k + 1;
+        first[k] = k;
+        unique++;
+        if (!keys[k].empty()) {
+            auto const c = static_cast<unsigned char>(keys[k][0]);
+            starts[c] = true;
+            if (envkey_icase && c >= 'a' && c <= 'z')
+                starts[c - ('a' - 'A')] = true;
+            if (envkey_icase && c >= 'A' && c <= 'Z')
+                starts[c + ('a' - 'A')] = true;
+        }
+    }
+
+    {
+        std::shared_lock lock{env_mutex};
+        auto const block = effective_block();
+
+        for (std::size_t i = 0; block && block[i] && unique != 0; i++)
+        {
+            auto const c = static_cast<std::make_unsigned_t<detail::envchar>>(block[i][0]);
+            // wide chars past the table can't be ruled out
+            if (static_cast<std::size_t>(c) < std::size(starts) && !starts[c])
+                continue;
+
+            auto const line = read_entry(block[i]);
+            auto const key = entry_key(line);
+            if (key.size() == line.size())
+                continue;
+
+            auto slot = *probe(key, envkey_hash(key));
+            // the first entry wins, like getenv
+            if (!slot || result.m_values[slot - 1].offset != value_list::missing)
+                continue;
+
+            auto const value = string_view(line).substr(key.size() + 1);
+            result.m_values[slot - 1] = {
+                static_cast<std::uint32_t>(result.m_buffer.size()),
+                static_cast<std::uint32_t>(value.size())
+            };
+            result.m_buffer += value;
+            unique--;
+        }
+    }
+
+    for (std::size_t k = 0; k < count; k++)
+        result.m_values[k] = result.m_values[first[k]];
+
+    return result;
+}
+
+auto environment::entries() const -> entry_list
+{
+    entry_list result;
+
+    std::shared_lock lock{env_mutex};
+    auto const block = effective_block();
+    if (!block)
+        return result;
+
+    // measure first, so the strings go in a single buffer
+    std::size_t strings_size = 0, count = 0;
+    for (; block[count]; count++)
+        strings_size += read_entry(block[count]).size();
+
+    result.m_strings = std::make_unique<char[]>(strings_size);
+    result.m_entries.reserve(count);
+
+    auto* next = result.m_strings.get();
+    for (std::size_t i = 0; i < count; i++)
+    {
+        auto const line = read_entry(block[i]);
+        string_view(line).copy(next, line.size());
+
+        auto const copy = string_view(next, line.size());
+        auto const key = entry_key(copy);
+        auto const value = key.size() < copy.size() ? copy.substr(key.size() + 1) : string_view(next + copy.size(), 0);
+        result.m_entries.push_back({key, value});
+        next += line.size();
+    }
+
+    return result;
+}
+
+std::uint64_t environment::generation() noexcept
+{
+    return sys::generation();
+}
+
+void environment::touch() noexcept
+{
+    sys::touch();
+}
+
+void environment::do_erase(string_view k)
+{
+    if (active_overlay) {
+        active_overlay->erase(k);
+        return;
+    }
+
+    std::unique_lock lock{env_mutex};
+    bool const existed = cache().find(k) != nullptr;
+    change_entries(existed ? -1 : 0, [&]{ sys::rmenv(k); });
+}
+
+auto environment::size() const noexcept -> size_type
+{
+    std::shared_lock lock{env_mutex};
+    if (active_overlay) {
+        active_overlay->block();
+        return active_overlay->m_block.size() - 1;
+    }
+
+    std::lock_guard count_lock{count_mutex};
+    auto const block = sys::envp();
+    auto const generation = sys::generation();
+    if (counted.block != block || counted.generation != generation)
+        counted = { block, generation, count_entries(block) };
+
+    return counted.count;
+}
+
+environment::snapshot::snapshot()
+{
+    std::shared_lock lock{env_mutex};
+    build(effective_block());
+}
+
+environment::snapshot::snapshot(detail::envblock block)
+{
+    build(block);
+}
+
+environment::snapshot::snapshot(std::shared_ptr<const std::byte[]> data, std::size_t size)
+{
+    attach(std::move(data), size);
+}
+
+namespace {
+
+    constexpr char snapshot_magic[8] = "REDSNAP";
+    constexpr std::uint32_t snapshot_byte_order = 0x01020304;
+    constexpr std::uint32_t snapshot_version = 1;
+    // how keys were hashed and compared
+    constexpr std::uint32_t snapshot_icase = 1;
+    constexpr std::uint32_t snapshot_flags = envkey_icase ? snapshot_icase : 0;
+
+    constexpr std::size_t snapshot_tables_size(std::uint32_t count, std::uint32_t slots) noexcept {
+        return sizeof(detail::snapshot_header) + count * sizeof(snapshot_entry) + slots * sizeof(snapshot_slot);
+    }
+
+} // unnamed namespace
+
+void environment::snapshot::build(detail::envblock block)
+{
+    m_generation = sys::generation();
+
+    std::vector<environment::string_type> lines;
+    for (auto c = cursor(block); block && !c.equal(ranges::default_sentinel); c.next())
+        lines.push_back(c.read());
+
+    std::stable_sort(lines.begin(), lines.end(), [](string_view a, string_view b) {
+        return as_key(entry_key(a)) < as_key(entry_key(b));
+    });
+
+    // one block holding the header, the entry table, the hash index and the strings
+    auto const count = static_cast<std::uint32_t>(lines.size());
+    std::uint32_t slots = 1;
+    while (slots < count * 2)
+        slots <<= 1;
+
+    std::size_t strings_size = 0;
+    for (string_view line : lines)
+        strings_size += line.size() + 1;
+
+    auto const tables_size = snapshot_tables_size(count, slots);
+    auto const size = tables_size + strings_size;
+    auto data = std::make_shared<std::byte[]>(size);
+
+    auto* header = reinterpret_cast<detail::snapshot_header*>(data.get());
+    std::copy(std::begin(snapshot_magic), std::end(snapshot_magic), header->magic);
+    header->byte_order = snapshot_byte_order;
+    header->version = snapshot_version;
+    header->flags = snapshot_flags;
+    header->count = count;
+    header->slots = slots;
+    header->strings_size = strings_size;
+
+    auto* entries = reinterpret_cast<snapshot_entry*>(header + 1);
+    auto* index = reinterpret_cast<snapshot_slot*>(entries + count);
+    auto* strings = reinterpret_cast<char*>(data.get() + tables_size);
+    auto const mask = slots - 1;
+
+    std::uint32_t offset = 0;
+    for (std::uint32_t i = 0; i < count; i++)
+    {
+        string_view const line = lines[i];
+        auto const key = entry_key(line);
+        line.copy(strings + offset, line.size());
+        entries[i] = { offset, static_cast<std::uint32_t>(key.size()), static_cast<std::uint32_t>(line.size()) };
+        offset += static_cast<std::uint32_t>(line.size() + 1);
+
+        auto const hash = envkey_hash(key);
+        auto* slot = probe_index(index, mask, entries, strings, key, hash);
+        // on duplicated keys the first one wins, like getenv
+        if (slot->entry == 0)
+            *slot = { hash, i + 1 };
+    }
+
+    attach(std::move(data), size);
+}
+
+void environment::snapshot::attach(std::shared_ptr<const std::byte[]> data, std::size_t size)
+{
+    auto* header = reinterpret_cast<detail::snapshot_header const*>(data.get());
+    auto* entries = reinterpret_cast<snapshot_entry const*>(header + 1);
+
+    m_entries = entries;
+    m_slots = reinterpret_cast<snapshot_slot const*>(entries + header->count);
+    m_strings = reinterpret_cast<char const*>(data.get() + snapshot_tables_size(header->count, header->slots));
+    m_count = header->count;
+    m_mask = header->slots - 1;
+    m_size = size;
+    m_data = std::move(data);
+}
+
+auto environment::snapshot::load(std::filesystem::path const& path) -> std::shared_ptr<const snapshot>
+{
+    std::size_t size = 0;
+    auto data = sys::map_file(path, size);
+
+    auto const invalid = [&] {
+        return std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                 path.string() + " is not a snapshot from this platform");
+    };
+
+    if (size < sizeof(detail::snapshot_header))
+        throw invalid();
+
+    auto const& header = *reinterpret_cast<detail::snapshot_header const*>(data.get());
+    bool const valid =
+        std::equal(std::begin(snapshot_magic), std::end(snapshot_magic), header.magic) &&
+        header.byte_order == snapshot_byte_order &&
+        header.version == snapshot_version &&
+        header.flags == snapshot_flags &&
+        // probes stop at an empty slot, a full index would never end them
+        header.slots != 0 && (header.slots & (header.slots - 1)) == 0 && header.slots > header.count &&
+        snapshot_tables_size(header.count, header.slots) + header.strings_size == size;
+    if (!valid)
+        throw invalid();
+
+    // one pass over the tables, so lookups and iteration stay in the mapping
+    auto const* entries = reinterpret_cast<snapshot_entry const*>(&header + 1);
+    for (std::uint32_t i = 0; i < header.count; i++) {
+        auto const& e = entries[i];
+        if (e.keylen > e.length || std::uint64_t(e.offset) + e.length > header.strings_size)
+            throw invalid();
+    }
+
+    auto const* slots = reinterpret_cast<snapshot_slot const*>(entries + header.count);
+    bool has_empty = false;
+    for (std::uint32_t i = 0; i < header.slots; i++) {
+        if (slots[i].entry > header.count)
+            throw invalid();
+        has_empty |= slots[i].entry == 0;
+    }
+    // probes stop at an empty slot
+    if (!has_empty)
+        throw invalid();
+
+    return std::shared_ptr<const snapshot>(new snapshot(std::move(data), size));
+}
+
+void environment::snapshot::save(std::filesystem::path const& path) const
+{
+    // processes may have the old file mapped, it's replaced instead of rewritten.
+    // the temporary is next to it, so the rename doesn't cross file systems
+    static std::atomic<std::uint64_t> saves{0};
+    auto temp = path;
+    temp += ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count())
+          + "." + std::to_string(saves++);
+
+    {
+        std::ofstream out{temp, std::ios::binary | std::ios::trunc};
+        out.write(reinterpret_cast<char const*>(m_data.get()), static_cast<std::streamsize>(m_size));
+        out.close();
+
+        if (!out) {
+            std::error_code ignored;
+            std::filesystem::remove(temp, ignored);
+            throw std::system_error(std::make_error_code(std::errc::io_error), "can't write " + path.string());
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+    if (error) {
+        std::error_code ignored;
+        std::filesystem::remove(temp, ignored);
+        throw std::system_error(error, "can't replace " + path.string());
+    }
+}
+
+auto environment::snapshot::lookup(string_view key) const noexcept -> detail::snapshot_entry const*
+{
+    auto* slot = probe_index(m_slots, m_mask, m_entries, m_strings, key, envkey_hash(key));
+    return slot->entry ? m_entries + slot->entry - 1 : nullptr;
+}
+
+auto environment::snapshot::find(string_view key) const noexcept -> iterator
+{
+    auto* e = lookup(key);
+    return iterator(detail::snapshot_cursor(e ? e : m_entries + m_count, m_strings));
+}
+
+string_view environment::snapshot::operator[] (string_view key) const noexcept
+{
+    auto* e = lookup(key);
+    if (!e || e->keylen >= e->length)
+        return {};
+
+    return { m_strings + e->offset + e->keylen + 1, e->length - e->keylen - 1 };
+}
+
+auto environment::snapshot::with_prefix(string_view prefix, bool strip) const noexcept -> prefix_view
+{
+    // keys are compared up to the prefix's length, the matches are a run of the sorted table
+    auto const truncated = [&](snapshot_entry const& e) {
+        return as_key({m_strings + e.offset, std::min<std::size_t>(e.keylen, prefix.size())});
+    };
+    auto const key = as_key(prefix);
+    auto const first = std::lower_bound(m_entries, m_entries + m_count, key, [&](snapshot_entry const& e, envkey_view p) {
+        return truncated(e) < p;
+    });
+    auto const last = std::upper_bound(first, m_entries + m_count, key, [&](envkey_view p, snapshot_entry const& e) {
+        return p < truncated(e);
+    });
+
+    prefix_view view;
+    view.m_first = first;
+    view.m_last = last;
+    view.m_strings = m_strings;
+    view.m_skip = strip ? prefix.size() : 0;
+    return view;
+}
+
+namespace {
+
+    // a prefix run with overrides merged in, laid out like the snapshot's tables
+    struct merged_run
+    {
+        std::vector<snapshot_entry> entries;
+        string strings;
+    };
+
+} // unnamed namespace
+
+auto environment::with_prefix(string_view prefix, bool strip) const -> prefix_view
+{
+    auto snap = snapshot::current();
+    auto view = snap->with_prefix(prefix, strip);
+    view.m_owner = std::move(snap);
+    if (!active_overlay)
+        return view;
+
+    // this thread's overrides under the prefix, the ones shadowed by an inner overlay left out
+    std::vector<overlay::entry const*> overrides;
+    for (auto* o = active_overlay; o; o = o->m_parent) {
+        for (auto& e : o->m_entries) {
+            auto const matches = e.key.size() >= prefix.size() && as_key(string_view(e.key).substr(0, prefix.size())) == as_key(prefix);
+            if (matches && active_overlay->lookup(e.key) == &e)
+                overrides.push_back(&e);
+        }
+    }
+    if (overrides.empty())
+        return view;
+
+    std::sort(overrides.begin(), overrides.end(), [](auto* a, auto* b) { return as_key(a->key) < as_key(b->key); });
+
+    auto merged = std::make_shared<merged_run>();
+    auto const add = [&](string_view key, string_view line) {
+        auto const size = [](std::size_t n) { return static_cast<std::uint32_t>(n); };
+        merged->entries.push_back({size(merged->strings.size()), size(key.size()), size(line.size())});
+        merged->strings.append(line);
+    };
+    auto const add_override = [&](overlay::entry const& e) {
+        if (!e.erased)
+            add(e.key, read_entry(e.line.c_str()));
+    };
+
+    // both are sorted, an override replaces every entry with its key
+    auto next = overrides.begin();
+    for (auto e = view.m_first; e != view.m_last; e++) {
+        string_view const line{view.m_strings + e->offset, e->length};
+        auto const key = line.substr(0, e->keylen);
+        for (; next != overrides.end() && as_key((*next)->key) < as_key(key); next++)
+            add_override(**next);
+        if (next == overrides.end() || as_key((*next)->key) != as_key(key))
+            add(key, line);
+    }
+    for (; next != overrides.end(); next++)
+        add_override(**next);
+
+    view.m_first = merged->entries.data();
+    view.m_last = merged->entries.data() + merged->entries.size();
+    view.m_strings = merged->strings.data();
+    view.m_merged = std::move(merged);
+    return view;
+}
+
+namespace {
+
+    // shell names, '.' and '-' end them
+    bool is_name_char(char c, bool first) noexcept {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' || (!first && c >= '0' && c <= '9');
+    }
+
+    // calls piece(view, fallback, is_variable) for the pieces of a template in order, every view is into 'text'.
+    // a literal's view is its text, a variable's is its name
+    template<class Fn>
+    void parse_expansion(string_view text, Fn&& piece)
+    {
+        // start of the literal that's not a piece yet
+        std::size_t literal = 0;
+        auto flush = [&](std::size_t end) {
+            if (end > literal)
+                piece(text.substr(literal, end - literal), text.substr(end, 0), false);
+        };
+
+        for (std::size_t i = 0; i < text.size();)
+        {
+            if (text[i] == '\\' && i + 1 < text.size() && text[i + 1] == '$') {
+                // the '$' starts the next literal
+                flush(i);
+                literal = i + 1;
+                i += 2;
+                continue;
+            }
+            if (text[i] != '$') {
+                i++;
+                continue;
+            }
+
+            if (i + 1 < text.size() && text[i + 1] == '{')
+            {
+                auto const close = text.find('}', i + 2);
+                if (close == string_view::npos)
+                    throw std::invalid_argument("unterminated '${' in \"" + string(text) + '"');
+
+                auto const ref = text.substr(i + 2, close - i - 2);
+                auto const dash = ref.find(":-");
+                auto const name = ref.substr(0, dash);
+                if (name.empty())
+                    throw std::invalid_argument("empty '${}' in \"" + string(text) + '"');
+
+                flush(i);
+                piece(name, dash != string_view::npos ? ref.substr(dash + 2) : ref.substr(ref.size()), true);
+                i = literal = close + 1;
+                continue;
+            }
+
+            auto end = i + 1;
+            while (end < text.size() && is_name_char(text[end], end == i + 1))
+                end++;
+            // a '$' without a name is literal
+            if (end == i + 1) {
+                i++;
+                continue;
+            }
+
+            flush(i);
+            piece(text.substr(i + 1, end - i - 1), text.substr(end, 0), true);
+            i = literal = end;
+        }
+        flush(text.size());
+    }
+
+} // unnamed namespace
+
+void environment::do_expand(string_view text, snapshot const& snap, void (*fn)(void*, string_view), void* context)
+{
+    parse_expansion(text, [&](string_view s, string_view fallback, bool variable) {
+        if (!variable)
+            return fn(context, s);
+
+        auto const emit = [&](string_view value) { fn(context, value.empty() ? fallback : value); };
+        // this thread's overrides win over the snapshot
+        if (auto* e = active_overlay ? active_overlay->lookup(s) : nullptr) {
+            if (e->erased)
+                return emit({});
+
+            auto const line = read_entry(e->line.c_str());
+            return emit(string_view(line).substr(e->key.size() + 1));
+        }
+        emit(snap[s]);
+    });
+}
+
+std::string environment::expand(string_view text) const
+{
+    auto const snap = snapshot::current();
+
+    // parsing is cheap, do it twice so the result is allocated once
+    std::size_t size = 0;
+    do_expand(text, *snap, [](void* size, string_view s) { *static_cast<std::size_t*>(size) += s.size(); }, &size);
+
+    std::string result;
+    result.reserve(size);
+    do_expand(text, *snap, [](void* result, string_view s) { static_cast<std::string*>(result)->append(s); }, &result);
+    return result;
+}
+
+environment::expansion::expansion(string_view text)
+    : m_text(text)
+{
+    auto const at = [&](string_view s) { return static_cast<std::uint32_t>(s.data() - text.data()); };
+    auto const length = [](string_view s) { return static_cast<std::uint32_t>(s.size()); };
+
+    parse_expansion(text, [&](string_view s, string_view fallback, bool variable) {
+        m_pieces.push_back({at(s), length(s), at(fallback), length(fallback), variable});
+    });
+}
+
+std::string environment::expansion::expand(snapshot const& snap) const
+{
+    std::size_t size = 0;
+    for (auto const& p : m_pieces)
+        size += resolve(snap, p).size();
+
+    std::string result;
+    result.reserve(size);
+    expand(snap, std::back_inserter(result));
+    return result;
+}
+
+auto environment::snapshot::current() -> std::shared_ptr<const snapshot>
+{
+    static std::shared_ptr<const snapshot> published;
+    static std::shared_mutex published_mutex;
+
+    std::shared_ptr<const snapshot> snap;
+    {
+        std::shared_lock lock{published_mutex};
+        snap = published;
+    }
+    if (snap && snap->m_generation == sys::generation())
+        return snap;
+
+    std::shared_ptr<const snapshot> fresh;
+    {
+        // the process' environment, overlays are per thread
+        std::shared_lock env_lock{env_mutex};
+        fresh.reset(new snapshot(sys::envp()));
+    }
+
+    // other readers may be publishing too, keep the newest
+    std::unique_lock lock{published_mutex};
+    if (!published || published->m_generation < fresh->m_generation)
+        published = fresh;
+
+    return fresh;
+}
+
+environment::overlay::overlay()
+    : m_parent(active_overlay)
+{
+    active_overlay = this;
+    overlay_changes++;
+}
+
+environment::overlay::~overlay()
+{
+    assert(active_overlay == this && "overlays must be destroyed in reverse order");
+    active_overlay = m_parent;
+    overlay_changes++;
+}
+
+auto environment::overlay::lookup(string_view key) const -> entry const*
+{
+    for (auto* o = this; o; o = o->m_parent) {
+        for (auto& e : o->m_entries) {
+            if (as_key(e.key) == as_key(key))
+                return &e;
+        }
+    }
+    return nullptr;
+}
+
+auto environment::overlay::upsert(string_view key) -> entry&
+{
+    overlay_changes++;
+    for (auto& e : m_entries) {
+        if (as_key(e.key) == as_key(key))
+            return e;
+    }
+    return m_entries.emplace_back(entry{ string(key), {}, false });
+}
+
+auto environment::overlay::set(string_view key, string_view value) -> overlay&
+{
+    auto& e = upsert(key);
+    string line;
+    line.reserve(key.size() + value.size() + 1);
+    line.append(key).append(1, '=').append(value);
+    e.line = sys::envstr(line);
+    e.erased = false;
+    return *this;
+}
+
+auto environment::overlay::erase(string_view key) -> overlay&
+{
+    auto& e = upsert(key);
+    e.line.clear();
+    e.erased = true;
+    return *this;
+}
+
+detail::envblock environment::overlay::block()
+{
+    if (!m_block.empty() && m_generation == sys::generation() && m_changes == overlay_changes)
+        return m_block.data();
+
+    m_block.clear();
+    if (auto base = sys::envp()) {
+        for (; *base; base++) {
+            if (!lookup(entry_key(read_entry(*base))))
+                m_block.push_back(*base);
+        }
+    }
+    // the overrides, from the innermost overlay down, skipping shadowed ones
+    for (auto* o = this; o; o = o->m_parent) {
+        for (auto& e : o->m_entries) {
+            if (!e.erased && lookup(e.key) == &e)
+                m_block.push_back(e.line.data());
+        }
+    }
+    m_block.push_back(nullptr);
+
+    m_generation = sys::generation();
+    m_changes = overlay_changes;
+    return m_block.data();
+}
+
+split_view::split_view(string_view s, char sep)
+    : m_size(s.size()), m_sep(sep)
+{
+    if (!s.empty()) {
+        auto buffer = std::make_shared<char[]>(s.size());
+        s.copy(buffer.get(), s.size());
+        m_buffer = std::move(buffer);
+    }
+}
+
+split_view::split_view(string_view s, char sep, std::pmr::memory_resource* resource)
+    : m_size(s.size()), m_sep(sep)
+{
+    if (!s.empty()) {
+        // the control block comes from 'resource' too
+        auto buffer = std::allocate_shared<char[]>(std::pmr::polymorphic_allocator<char>(resource), s.size());
+        s.copy(buffer.get(), s.size());
+        m_buffer = std::move(buffer);
+    }
+}
+
+void detail::staged_changes::set(string_view key, string_view value)
+{
+    m_changes.push_back({ m_buffer.size(), key.size(), key.size() + value.size() + 1, false, false });
+    m_buffer.append(key).append(1, '=').append(value);
+    m_resolved = false;
+}
+
+void detail::staged_changes::erase(string_view key)
+{
+    m_changes.push_back({ m_buffer.size(), key.size(), key.size(), true, false });
+    m_buffer.append(key);
+    m_resolved = false;
+}
+
+auto detail::staged_changes::resolve() -> std::vector<change>&
+{
+    if (m_resolved)
+        return m_changes;
+
+    std::stable_sort(m_changes.begin(), m_changes.end(), [this](change const& a, change const& b) {
+        return as_key(key(a)) < as_key(key(b));
+    });
+
+    auto out = m_changes.begin();
+    for (auto it = m_changes.begin(); it != m_changes.end(); )
+    {
+        auto run_end = std::next(it);
+        while (run_end != m_changes.end() && as_key(key(*run_end)) == as_key(key(*it)))
+            run_end++;
+
+        *out++ = *std::prev(run_end);
+        it = run_end;
+    }
+    m_changes.erase(out, m_changes.end());
+
+    m_resolved = true;
+    return m_changes;
+}
+
+namespace {
+
+    bool is_blank(char c) noexcept {
+        return c == ' ' || c == '\t';
+    }
+
+    bool is_key_char(char c, bool first) noexcept {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_' ||
+            (!first && ((c >= '0' && c <= '9') || c == '.' || c == '-'));
+    }
+
+    // calls set(key, value) for every variable in a .env text, unescaped values are built in 'scratch'
+    template<class Fn>
+    void read_dotenv(string_view text, string& scratch, Fn&& set)
+    {
+        std::size_t i = 0, line = 1;
+        auto const n = text.size();
+
+        auto const fail = [&](char const* what) {
+            throw std::invalid_argument("line " + std::to_string(line) + ": " + what);
+        };
+        auto const skip_blanks = [&] {
+            while (i < n && is_blank(text[i]))
+                i++;
+        };
+        auto const at_line_end = [&] {
+            return i == n || text[i] == '\n' || (text[i] == '\r' && (i + 1 == n || text[i + 1] == '\n'));
+        };
+        auto const next_line = [&] {
+            while (i < n && text[i] != '\n')
+                i++;
+            if (i < n) {
+                i++;
+                line++;
+            }
+        };
+        auto const count_lines = [&](string_view s) {
+            line += std::count(s.begin(), s.end(), '\n');
+        };
+
+        while (i < n)
+        {
+            skip_blanks();
+            if (at_line_end() || text[i] == '#') {
+                next_line();
+                continue;
+            }
+
+            if (text.substr(i, 6) == "export" && i + 6 < n && is_blank(text[i + 6])) {
+                i += 6;
+                skip_blanks();
+            }
+
+            auto const key_start = i;
+            while (i < n && is_key_char(text[i], i == key_start))
+                i++;
+            auto const key = text.substr(key_start, i - key_start);
+            if (key.empty())
+                fail("expected a key");
+
+            skip_blanks();
+            if (i == n || text[i] != '=')
+                fail("expected '=' after the key");
+            i++;
+            skip_blanks();
+
+            if (i < n && text[i] == '\'')
+            {
+                auto const close = text.find('\'', i + 1);
+                if (close == string_view::npos)
+                    fail("unterminated quote");
+
+                auto const value = text.substr(i + 1, close - i - 1);
+                count_lines(value);
+                set(key, value);
+                i = close + 1;
+            }
+            else if (i < n && text[i] == '"')
+            {
+                scratch.clear();
+                for (i++; ; i += 2)
+                {
+                    auto const stop = text.find_first_of("\"\\", i);
+                    if (stop == string_view::npos || (stop + 1 == n && text[stop] == '\\'))
+                        fail("unterminated quote");
+
+                    auto const chunk = text.substr(i, stop - i);
+                    count_lines(chunk);
+                    scratch += chunk;
+                    i = stop;
+                    if (text[i] == '"') {
+                        i++;
+                        break;
+                    }
+
+                    switch (char const c = text[i + 1]) {
+                        case 'n': scratch += '\n'; break;
+                        case 't': scratch += '\t'; break;
+                        case 'r': scratch += '\r'; break;
+                        case '\\': case '"': case '$': case '\'': scratch += c; break;
+                        // a line continuation
+                        case '\n': line++; break;
+                        default: scratch.append({'\\', c}); break;
+                    }
+                }
+                set(key, scratch);
+            }
+            else
+            {
+                // up to the end of the line, or a comment after a blank
+                auto const start = i;
+                while (!at_line_end() && !(text[i] == '#' && is_blank(text[i - 1])))
+                    i++;
+
+                auto value = text.substr(start, i - start);
+                while (!value.empty() && is_blank(value.back()))
+                    value.remove_suffix(1);
+                set(key, value);
+            }
+
+            skip_blanks();
+            if (i < n && text[i] != '#' && !at_line_end())
+                fail("unexpected text after the value");
+            next_line();
+        }
+    }
+
+} // unnamed namespace
+
+auto environment::transaction::parse_dotenv(string_view text) -> transaction&
+{
+    auto const mark = m_changes.mark();
+    string scratch;
+    try {
+        read_dotenv(text, scratch, [this](string_view key, string_view value) { m_changes.set(key, value); });
+    }
+    catch (...) {
+        m_changes.rollback(mark);
+        throw;
+    }
+    return *this;
+}
+
+auto environment::transaction::load_dotenv(std::filesystem::path const& path) -> transaction&
+{
+    std::size_t size = 0;
+    auto const data = sys::map_file(path, size);
+    try {
+        return parse_dotenv({ reinterpret_cast<char const*>(data.get()), size });
+    }
+    catch (std::invalid_argument const& e) {
+        throw std::invalid_argument(path.string() + ", " + e.what());
+    }
+}
+
+void environment::transaction::commit()
+{
+    if (m_changes.empty())
+        return;
+
+    if (active_overlay) {
+        for (auto& c : m_changes.resolve()) {
+            if (c.erase)
+                active_overlay->erase(m_changes.key(c));
+            else
+                active_overlay->set(m_changes.key(c), m_changes.value(c));
+        }
+    }
+    else {
+        std::unique_lock lock{env_mutex};
+        commit_changes(m_changes);
+    }
+
+    m_changes.clear();
+}
+
+char** environment::envp_builder::build()
+{
+    std::shared_lock lock{env_mutex};
+    auto const base = effective_block();
+
+    // measure first, so the buffers are filled without moving
+    std::size_t strings_size = 0, count = 0;
+    auto measure = [&](string_view line) {
+        strings_size += line.size() + 1;
+        count++;
+    };
+    merge_changes(base, m_changes,
+        [&](detail::envchar* entry) { measure(read_entry(entry)); },
+        [&](detail::staged_changes::change const& c) { measure(m_changes.line(c)); });
+
+    m_strings.resize(strings_size);
+    m_pointers.clear();
+    m_pointers.reserve(count + 1);
+
+    auto* next = m_strings.data();
+    auto append = [&](string_view line) {
+        line.copy(next, line.size());
+        next[line.size()] = '\0';
+        m_pointers.push_back(next);
+        next += line.size() + 1;
+    };
+    merge_changes(base, m_changes,
+        [&](detail::envchar* entry) { append(read_entry(entry)); },
+        [&](detail::staged_changes::change const& c) { append(m_changes.line(c)); });
+    m_pointers.push_back(nullptr);
+
+    return m_pointers.data();
+}
+
+namespace {
+
+    std::uint32_t option_hash(string_view name, bool is_short) noexcept
+    {
+        std::uint32_t hash = (2166136261u ^ is_short) * 16777619u;
+        for (unsigned char c : name)
+            hash = (hash ^ c) * 16777619u;
+        return hash;
+    }
+
+    // walks the slots starting at 'hash', stops at the slot holding 'name' or at the first empty one
+    template<class Slot>
+    Slot* probe_options(Slot* slots, std::size_t mask, detail::option_entry const* entries,
+                        string_view name, bool is_short, std::uint32_t hash) noexcept
+    {
+        for (auto i = hash & mask; ; i = (i + 1) & mask)
+        {
+            if (slots[i] == 0)
+                return slots + i;
+
+            auto const& e = entries[slots[i] - 1];
+            if (e.hash == hash && e.is_short == is_short && e.name == name)
+                return slots + i;
+        }
+    }
+
+} // unnamed namespace
+
+namespace {
+
+    // 'name' is without dashes, 'with_values' are spelled with them
+    bool takes_value(string_view name, bool is_short, std::initializer_list<string_view> with_values) noexcept
+    {
+        auto const dashes = is_short ? 1u : 2u;
+        return std::any_of(with_values.begin(), with_values.end(), [&](string_view option) {
+            return option.size() == name.size() + dashes && option.find_first_not_of('-') == dashes &&
+                   option.substr(dashes) == name;
+        });
+    }
+
+} // unnamed namespace
+
+void options::parse(string_view arg, std::initializer_list<string_view> with_values)
+{
+    // the option before asked for this argument, whatever it looks like
+    if (m_pending) {
+        auto& e = m_entries[std::exchange(m_pending, 0) - 1];
+        e.value = arg;
+        e.has_value = true;
+        return;
+    }
+
+    bool const is_number = arg.size() > 1 && arg[1] >= '0' && arg[1] <= '9';
+    if (m_only_positional || arg.size() < 2 || arg[0] != '-' || is_number) {
+        m_positional.push_back(arg);
+        return;
+    }
+
+    if (arg == "--") {
+        m_only_positional = true;
+    }
+    else if (arg[1] == '-') {
+        arg.remove_prefix(2);
+        auto const eq = arg.find('=');
+        if (eq == string_view::npos) {
+            m_entries.push_back({arg, {}, 0, 0, false, false});
+            if (takes_value(arg, false, with_values))
+                m_pending = m_entries.size();
+        }
+        else m_entries.push_back({arg.substr(0, eq), arg.substr(eq + 1), 0, 0, false, true});
+    }
+    else {
+        // a group of short options, one that takes a value ends it
+        for (std::size_t i = 1; i < arg.size(); i++)
+        {
+            auto const name = arg.substr(i, 1);
+            if (!takes_value(name, true, with_values)) {
+                m_entries.push_back({name, {}, 0, 0, true, false});
+                continue;
+            }
+
+            if (i + 1 < arg.size())
+                m_entries.push_back({name, arg.substr(i + 1), 0, 0, true, true});
+            else {
+                m_entries.push_back({name, {}, 0, 0, true, false});
+                m_pending = m_entries.size();
+            }
+            break;
+        }
+    }
+}
+
+void options::build_index()
+{
+    // at most half full
+    std::size_t size = 8;
+    while (size < m_entries.size() * 2)
+        size *= 2;
+
+    m_slots.assign(size, 0);
+    for (std::uint32_t i = 0; i < m_entries.size(); i++)
+    {
+        auto& e = m_entries[i];
+        e.hash = option_hash(e.name, e.is_short);
+
+        auto slot = probe_options(m_slots.data(), size - 1, m_entries.data(), e.name, e.is_short, e.hash);
+        e.count = *slot ? m_entries[*slot - 1].count + 1 : 1;
+        *slot = i + 1;
+    }
+}
+
+detail::option_entry const* options::find(string_view name) const noexcept
+{
+    if (m_slots.empty())
+        return nullptr;
+
+    bool is_short = false;
+    if (name.starts_with("--")) {
+        name.remove_prefix(2);
+    }
+    else if (name.size() > 1 && name[0] == '-') {
+        name.remove_prefix(1);
+        is_short = true;
+    }
+
+    auto const hash = option_hash(name, is_short);
+    auto slot = *probe_options(m_slots.data(), m_slots.size() - 1, m_entries.data(), name, is_short, hash);
+    return slot ? &m_entries[slot - 1] : nullptr;
+}
+
+} // namespace red::session
@@ -5,7 +5,21 @@
 #include <array>
 #include <vector>
 #include <utility>
+#include <functional>
 #include <typeinfo>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <filesystem>
+#include <memory_resource>
+#if defined(__unix__)
+#   include <sys/mman.h>
+#   include <sys/wait.h>
+#   include <unistd.h>
+#endif
 
 #include <range/v3/view.hpp>
 #include <range/v3/action.hpp>
@@ -13,6 +27,10 @@
 #include <range/v3/algorithm.hpp>
 
 #include "red/sessions/session.hpp"
+#include "red/sessions/process.hpp"
+#include "red/sessions/options.hpp"
+#include "red/sessions/key_table.hpp"
+#include "key_matcher.hpp"
 
 using namespace std::literals;
 
@@ -23,6 +41,7 @@ namespace sys
     void rmenv(std::string_view key);
 }
 
+
 using std::string;
 using std::string_view;
 using keyval_pair = std::pair<string_view, string_view>;
@@ -54,6 +73,23 @@ public:
 
 static red::session::environment environment;
 
+// checks variables from a static destructor, after the library's own statics would be gone.
+// it's constructed before main, so it's destroyed after them
+struct exit_check
+{
+    std::vector<keyval_pair> expected;
+
+    ~exit_check() {
+        for (auto [key, value] : expected) {
+            auto const found = ::getenv(string(key).c_str());
+            if (!found || found != value) {
+                std::fprintf(stderr, "%s is wrong during static destruction\n", string(key).c_str());
+                std::_Exit(EXIT_FAILURE);
+            }
+        }
+    }
+} exit_checker;
+
 //---
 
 TEST_CASE("get environment variables", "[env]")
@@ -89,6 +125,14 @@ TEST_CASE("get environment variables", "[env]")
         }
         
         REQUIRE_FALSE(environment.contains("nonesuch"));
+
+#if !defined(WIN32) // setting an empty value erases it
+        // an empty value still exists
+        environment["EMPTYVAR"] = "";
+        REQUIRE(environment.contains("EMPTYVAR"));
+        environment.erase("EMPTYVAR");
+        REQUIRE_FALSE(environment.contains("EMPTYVAR"));
+#endif
     }
     SECTION("from external changes")
     {
@@ -123,6 +167,282 @@ TEST_CASE("remove environment variables", "[env]")
     REQUIRE(environment.find("PROTOCOL") == environment.end());
 }
 
+#if defined(SESSIONS_OWNED_STORAGE)
+TEST_CASE("owned storage", "[env]")
+{
+    environment["OWNEDVAR"] = "first value";
+    auto const line = ::getenv("OWNEDVAR");
+    REQUIRE(line == "first value"sv);
+
+    // the string is reused while the value fits
+    for (int i = 0; i < 1000; i++)
+        environment["OWNEDVAR"] = std::to_string(i);
+    REQUIRE(::getenv("OWNEDVAR") == line);
+    REQUIRE(environment["OWNEDVAR"].value() == "999");
+
+    environment["OWNEDVAR"] = string(100, 'x');
+    REQUIRE(::getenv("OWNEDVAR") == string(100, 'x'));
+
+    // changes made behind the library's back are kept
+    ::unsetenv("OWNEDVAR");
+    ::setenv("RAWVAR", "raw", true);
+    environment["OWNEDVAR"] = "back";
+    REQUIRE(::getenv("OWNEDVAR") == "back"sv);
+    REQUIRE(::getenv("RAWVAR") == "raw"sv);
+
+    environment.erase("OWNEDVAR");
+    ::unsetenv("RAWVAR");
+    environment.touch();
+    REQUIRE_FALSE(environment.contains("OWNEDVAR"));
+}
+#endif
+
+TEST_CASE("cached lookups see every change", "[env]")
+{
+    test_vars_guard _;
+    auto const generation = environment.generation();
+
+    REQUIRE(environment["SERVER"].value() == "127.0.0.1");
+    environment["SERVER"] = "localhost";
+    REQUIRE(environment.generation() != generation);
+    REQUIRE(environment["SERVER"].value() == "localhost");
+
+#if !defined(WIN32)
+    SECTION("raw replacements")
+    {
+        ::setenv("SERVER", "10.0.0.1", true);
+        REQUIRE(environment["SERVER"].value() == "10.0.0.1");
+    }
+    SECTION("raw additions and removals")
+    {
+        REQUIRE_FALSE(environment.contains("RAWVAR"));
+        ::setenv("RAWVAR", "1", true);
+        environment.touch();
+        REQUIRE(environment.contains("RAWVAR"));
+
+        ::unsetenv("RAWVAR");
+        REQUIRE_FALSE(environment.contains("RAWVAR"));
+    }
+#endif
+}
+
+TEST_CASE("environment size", "[env]")
+{
+    test_vars_guard _;
+    auto const count = [] { return (size_t)ranges::distance(environment.begin(), environment.end()); };
+    auto const env_size = environment.size();
+    REQUIRE(env_size == count());
+
+    environment["SIZEVAR"] = "1";
+    REQUIRE(environment.size() == env_size + 1);
+    environment["SIZEVAR"] = "2";
+    REQUIRE(environment.size() == env_size + 1);
+    environment.erase("SIZEVAR");
+    environment.erase("SIZEVAR");
+    REQUIRE(environment.size() == env_size);
+
+    sys::setenv("SIZEVAR", "3");
+    REQUIRE(environment.size() == count());
+    sys::rmenv("SIZEVAR");
+    REQUIRE(environment.size() == env_size);
+}
+
+TEST_CASE("environment overlays", "[env]")
+{
+    using overlay = red::session::environment::overlay;
+    test_vars_guard _;
+    auto const env_size = environment.size();
+
+    {
+        overlay over;
+        over.set("SERVER", "localhost").set("OVERLAID", "yes").erase("PROTOCOL");
+
+        REQUIRE(environment["SERVER"].value() == "localhost");
+        REQUIRE(environment["OVERLAID"].value() == "yes");
+        REQUIRE(environment["DRUAGA1"].value() == "WEED");
+        REQUIRE_FALSE(environment.contains("PROTOCOL"));
+        REQUIRE(environment.find("PROTOCOL") == environment.end());
+        REQUIRE(*environment.find("OVERLAID") == "OVERLAID=yes"sv);
+        REQUIRE(environment.size() == env_size);
+        REQUIRE((size_t)ranges::distance(environment) == env_size);
+        REQUIRE(sys::getenv("SERVER") == "127.0.0.1");
+
+        environment["WRITTEN"] = "here";
+        REQUIRE(environment["WRITTEN"].value() == "here");
+        REQUIRE(sys::getenv("WRITTEN").empty());
+
+        SECTION("nested")
+        {
+            {
+                overlay inner;
+                inner.set("SERVER", "inner");
+                REQUIRE(environment["SERVER"].value() == "inner");
+                REQUIRE(environment["OVERLAID"].value() == "yes");
+            }
+            REQUIRE(environment["SERVER"].value() == "localhost");
+        }
+        SECTION("other threads don't see it")
+        {
+            string seen;
+            std::thread([&]{ seen = environment["SERVER"].value(); }).join();
+            REQUIRE(seen == "127.0.0.1");
+        }
+    }
+
+    REQUIRE(environment["SERVER"].value() == "127.0.0.1");
+    REQUIRE(environment.contains("PROTOCOL"));
+    REQUIRE_FALSE(environment.contains("OVERLAID"));
+    REQUIRE(environment.size() == env_size);
+}
+
+TEST_CASE("variables outlive static destruction", "[env]")
+{
+    red::session::environment::transaction{}.set("TXEXIT", "value").commit();
+    exit_checker.expected.push_back({"TXEXIT", "value"});
+
+    // with owned storage the library holds the block and the strings
+    environment["SETEXIT"] = "value";
+    exit_checker.expected.push_back({"SETEXIT", "value"});
+}
+
+TEST_CASE("environment transactions", "[env]")
+{
+    test_vars_guard _;
+    auto const env_size = environment.size();
+
+    red::session::environment::transaction transaction;
+    transaction.set("SERVER", "localhost")
+        .set("TXVAR", "1")
+        .erase("PROTOCOL")
+        .set("TXVAR", "2")
+        .erase("nonesuch");
+
+    REQUIRE(environment["SERVER"].value() == "127.0.0.1");
+    REQUIRE_FALSE(environment.contains("TXVAR"));
+
+    transaction.commit();
+    REQUIRE(transaction.empty());
+
+    REQUIRE(environment["SERVER"].value() == "localhost");
+    REQUIRE(environment["TXVAR"].value() == "2");
+    REQUIRE_FALSE(environment.contains("PROTOCOL"));
+    REQUIRE(environment.size() == env_size);
+    REQUIRE(environment.size() == (size_t)ranges::distance(environment));
+    REQUIRE(sys::getenv("TXVAR") == "2");
+
+    // the system can keep changing it
+    sys::setenv("TXVAR", "3");
+    sys::setenv("TXVAR2", "4");
+    REQUIRE(environment["TXVAR"].value() == "3");
+    REQUIRE(environment["TXVAR2"].value() == "4");
+
+    transaction.erase("TXVAR").erase("TXVAR2").commit();
+    REQUIRE_FALSE(environment.contains("TXVAR"));
+    REQUIRE_FALSE(environment.contains("TXVAR2"));
+    REQUIRE(environment.size() == env_size - 1);
+}
+
+TEST_CASE(".env files", "[env]")
+{
+    red::session::environment::transaction transaction;
+
+    auto const text =
+        "# a comment\n"
+        "\n"
+        "DOTENV_PLAIN=plain value  # trailing comment\n"
+        "export DOTENV_EXPORTED = exported\r\n"
+        "  DOTENV_HASH=a#b\n"
+        "DOTENV_SINGLE='literal \\n $HOME'\n"
+        "DOTENV_DOUBLE=\"line\\nbreak \\\"quoted\\\" \\$x \\q\"\n"
+        "DOTENV_MULTI=\"first\n"
+        "second\" # comment\n"
+        "DOTENV_EMPTY=\n"
+        "DOTENV_LAST=last"sv;
+
+    transaction.parse_dotenv(text);
+    REQUIRE(environment["DOTENV_PLAIN"].value().empty());
+    transaction.commit();
+
+    REQUIRE(environment["DOTENV_PLAIN"].value() == "plain value");
+    REQUIRE(environment["DOTENV_EXPORTED"].value() == "exported");
+    REQUIRE(environment["DOTENV_HASH"].value() == "a#b");
+    REQUIRE(environment["DOTENV_SINGLE"].value() == "literal \\n $HOME");
+    REQUIRE(environment["DOTENV_DOUBLE"].value() == "line\nbreak \"quoted\" $x \\q");
+    REQUIRE(environment["DOTENV_MULTI"].value() == "first\nsecond");
+    REQUIRE(environment["DOTENV_EMPTY"].value().empty());
+    REQUIRE(environment["DOTENV_LAST"].value() == "last");
+
+    SECTION("malformed lines stage nothing")
+    {
+        transaction.set("DOTENV_KEPT", "1");
+        REQUIRE_THROWS_WITH(transaction.parse_dotenv("DOTENV_BAD1=1\n\nDOTENV_BAD2 1\n"),
+                            Catch::Matchers::StartsWith("line 3"));
+        REQUIRE_THROWS_AS(transaction.parse_dotenv("DOTENV_BAD=\"open\n"), std::invalid_argument);
+        REQUIRE_THROWS_AS(transaction.parse_dotenv("DOTENV_BAD='a' b\n"), std::invalid_argument);
+        REQUIRE_THROWS_AS(transaction.parse_dotenv("1DOTENV=1\n"), std::invalid_argument);
+        transaction.commit();
+
+        REQUIRE(environment["DOTENV_KEPT"].value() == "1");
+        REQUIRE_FALSE(environment.contains("DOTENV_BAD1"));
+        environment.erase("DOTENV_KEPT");
+    }
+    SECTION("from a file")
+    {
+        auto const path = std::filesystem::temp_directory_path() / "red-sessions-test.env";
+        {
+            std::ofstream out{path, std::ios::binary | std::ios::trunc};
+            out << "DOTENV_FILE=from file\n";
+        }
+        transaction.load_dotenv(path).commit();
+        std::filesystem::remove(path);
+
+        REQUIRE(environment["DOTENV_FILE"].value() == "from file");
+        environment.erase("DOTENV_FILE");
+        REQUIRE_THROWS_AS(transaction.load_dotenv(path), std::system_error);
+    }
+
+    for (auto key : {"DOTENV_PLAIN", "DOTENV_EXPORTED", "DOTENV_HASH", "DOTENV_SINGLE", "DOTENV_DOUBLE",
+                     "DOTENV_MULTI", "DOTENV_EMPTY", "DOTENV_LAST"})
+        transaction.erase(key);
+    transaction.commit();
+}
+
+TEST_CASE("envp builder", "[env]")
+{
+    test_vars_guard _;
+    red::session::environment::envp_builder builder;
+    REQUIRE(builder.data()[0] == nullptr);
+
+    builder.set("SERVER", "localhost").set("CHILDVAR", "1").erase("PROTOCOL");
+    char** envp = builder.build();
+
+    auto entries = builder | ranges::to_vector;
+    REQUIRE(entries.size() == environment.size());
+    REQUIRE(envp[entries.size()] == nullptr);
+    REQUIRE(ranges::find(entries, "SERVER=localhost"sv) != entries.end());
+    REQUIRE(ranges::find(entries, "CHILDVAR=1"sv) != entries.end());
+    REQUIRE(ranges::find(entries, "DRUAGA1=WEED"sv) != entries.end());
+    REQUIRE(ranges::none_of(entries, [](string_view e) { return e.starts_with("PROTOCOL="); }));
+
+    // the environment it self is left alone
+    REQUIRE(environment["SERVER"].value() == "127.0.0.1");
+    REQUIRE_FALSE(environment.contains("CHILDVAR"));
+
+    SECTION("buffers are reused")
+    {
+        auto const strings = envp[0];
+        REQUIRE(builder.build() == envp);
+        REQUIRE(envp[0] == strings);
+    }
+    SECTION("changes can be dropped")
+    {
+        builder.clear();
+        builder.build();
+        REQUIRE((size_t)ranges::distance(builder) == environment.size());
+        REQUIRE(ranges::find(builder, "SERVER=127.0.0.1"sv) != builder.end());
+    }
+}
+
 TEST_CASE("environment iteration", "[env]")
 {
     using namespace ranges;
@@ -151,7 +471,289 @@ TEST_CASE("environment iteration", "[env]")
         CHECK(*it1 != *it2);
         REQUIRE(string(*it1) != string(*it2));
     }
+#if !defined(WIN32)
+    SECTION("entries are views into environ")
+    {
+        test_vars_guard _;
+        static_assert(std::same_as<ranges::range_value_t<decltype(environment)>, string_view>);
+
+        auto it = environment.find("SERVER");
+        REQUIRE(it != environment.end());
+        string_view line = *it;
+        REQUIRE(line == "SERVER=127.0.0.1");
+        REQUIRE(line.data() + line.find('=') + 1 == ::getenv("SERVER"));
+
+        auto values = environment.values();
+        REQUIRE(ranges::find(values, "127.0.0.1"sv) != values.end());
+        auto keys = environment.keys();
+        REQUIRE(ranges::find(keys, "SERVER"sv) != keys.end());
+    }
+#endif
+}
+
+TEST_CASE("environment entries", "[env]")
+{
+    environment["ENTRYVAR"] = "a=b";
+    auto const entries = environment.entries();
+    REQUIRE(entries.size() == environment.size());
+
+    auto it = ranges::find_if(entries, [](auto const& e) { return e.key == "ENTRYVAR"; });
+    REQUIRE(it != entries.end());
+    auto const [key, value] = *it;
+    REQUIRE(value == "a=b");
+
+    // the entries are copies
+    environment.erase("ENTRYVAR");
+    REQUIRE(key == "ENTRYVAR");
+    REQUIRE(entries[it - entries.begin()].value == "a=b");
+
+    // keys and values match the other views
+    auto const keys = environment.keys() | ranges::to_vector;
+    auto const now = environment.entries();
+    REQUIRE(now.size() == keys.size());
+    for (std::size_t i = 0; i < keys.size(); i++)
+        REQUIRE(now[i].key == keys[i]);
+}
+
+TEST_CASE("entries with a prefix", "[env]")
+{
+    environment["APP_DB_HOST"] = "localhost";
+    environment["APP_DB_PORT"] = "5432";
+    environment["APP_DBX"] = "not db";
+    environment["APP_CACHE_SIZE"] = "64";
+
+    SECTION("snapshot")
+    {
+        red::session::environment::snapshot const snapshot;
+        auto const db = snapshot.with_prefix("APP_DB_");
+        REQUIRE(db.size() == 2);
+        REQUIRE(db[0].key == "APP_DB_HOST");
+        REQUIRE(db[0].value == "localhost");
+        REQUIRE(db[1].key == "APP_DB_PORT");
+
+        auto const stripped = snapshot.with_prefix("APP_DB_", true);
+        auto const [key, value] = stripped[1];
+        REQUIRE(key == "PORT");
+        REQUIRE(value == "5432");
+
+        REQUIRE(snapshot.with_prefix("APP_").size() == 4);
+        REQUIRE(snapshot.with_prefix("APP_NONE_").empty());
+        REQUIRE(snapshot.with_prefix("").size() == snapshot.size());
+    }
+    SECTION("environment")
+    {
+        auto const cache = environment.with_prefix("APP_CACHE_", true);
+        REQUIRE(cache.size() == 1);
+        REQUIRE(cache[0].key == "SIZE");
+
+        // each call sees the latest changes
+        environment["APP_CACHE_TTL"] = "10";
+        REQUIRE(environment.with_prefix("APP_CACHE_").size() == 2);
+        REQUIRE(cache.size() == 1);
+        environment.erase("APP_CACHE_TTL");
+    }
+    SECTION("overlays are seen")
+    {
+        using overlay = red::session::environment::overlay;
+        overlay outer;
+        outer.set("APP_DB_USER", "me").set("APP_DB_HOST", "db.local");
+        overlay inner;
+        inner.erase("APP_DB_PORT").set("APP_DB_HOST", "inner").set("APP_DBA", "not db");
+
+        auto const db = environment.with_prefix("APP_DB_", true);
+        REQUIRE(db.size() == 2);
+        REQUIRE(db[0].key == "HOST");
+        REQUIRE(db[0].value == "inner");
+        REQUIRE(db[1].key == "USER");
+        REQUIRE(db[1].value == "me");
+
+        REQUIRE(environment.with_prefix("APP_").size() == 5);
+        REQUIRE(environment.with_prefix("APP_CACHE_").size() == 1);
+    }
+
+    for (auto key : {"APP_DB_HOST", "APP_DB_PORT", "APP_DBX", "APP_CACHE_SIZE"})
+        environment.erase(key);
+}
+
+TEST_CASE("expanding variables", "[env]")
+{
+    environment["EXPANDHOME"] = "/home/me";
+    environment["EXPANDAPP"] = "app";
+    environment["EXPANDEMPTY"] = "";
+
+    REQUIRE(environment.expand("${EXPANDHOME}/cache/${EXPANDAPP}") == "/home/me/cache/app");
+    REQUIRE(environment.expand("$EXPANDHOME/$EXPANDAPP.log") == "/home/me/app.log");
+    REQUIRE(environment.expand("no references") == "no references");
+    REQUIRE(environment.expand("") == "");
+
+    SECTION("defaults")
+    {
+        REQUIRE(environment.expand("${NOTEXPANDVAR:-/tmp}/x") == "/tmp/x");
+        REQUIRE(environment.expand("${EXPANDAPP:-other}") == "app");
+        REQUIRE(environment.expand("[${EXPANDEMPTY:-unset}]") == "[unset]");
+        REQUIRE(environment.expand("[${NOTEXPANDVAR}]") == "[]");
+    }
+    SECTION("escapes")
+    {
+        REQUIRE(environment.expand("\\$EXPANDAPP costs $5 or 100$") == "$EXPANDAPP costs $5 or 100$");
+        // other backslashes are kept
+        REQUIRE(environment.expand("C:\\dir\\x$EXPANDAPP") == "C:\\dir\\xapp");
+    }
+    SECTION("errors")
+    {
+        REQUIRE_THROWS_AS(environment.expand("${EXPANDAPP"), std::invalid_argument);
+        REQUIRE_THROWS_AS(environment.expand("${}"), std::invalid_argument);
+    }
+    SECTION("output iterators")
+    {
+        string out = ">";
+        environment.expand("$EXPANDAPP", std::back_inserter(out));
+        REQUIRE(out == ">app");
+
+        char buffer[32];
+        auto const end = environment.expand("${EXPANDHOME}/$EXPANDAPP", buffer);
+        REQUIRE(string_view(buffer, end - buffer) == "/home/me/app");
+    }
+    SECTION("overlays are seen")
+    {
+        red::session::environment::overlay overlay;
+        overlay.set("EXPANDAPP", "other").erase("EXPANDHOME");
+        REQUIRE(environment.expand("${EXPANDHOME:-~}/$EXPANDAPP") == "~/other");
+
+        string out;
+        environment.expand("$EXPANDAPP", std::back_inserter(out));
+        REQUIRE(out == "other");
+    }
+    SECTION("precompiled")
+    {
+        red::session::environment::expansion const path{"${EXPANDHOME}/${EXPANDAPP:-none}"};
+        red::session::environment::snapshot const before;
+        environment.erase("EXPANDAPP");
+        red::session::environment::snapshot const after;
+
+        REQUIRE(path.expand(before) == "/home/me/app");
+        REQUIRE(path.expand(after) == "/home/me/none");
+    }
 
+    for (auto key : {"EXPANDHOME", "EXPANDAPP", "EXPANDEMPTY"})
+        environment.erase(key);
+}
+
+TEST_CASE("environment snapshot", "[env]")
+{
+    test_vars_guard _;
+    red::session::environment::snapshot snapshot;
+
+    REQUIRE(snapshot.size() == environment.size());
+
+    for(auto[key, value] : TEST_VARS)
+    {
+        REQUIRE(snapshot.contains(key));
+        REQUIRE(snapshot[key] == value);
+        auto it = snapshot.find(key);
+        REQUIRE(it != snapshot.end());
+        REQUIRE(*it == string(key) + "=" + string(value));
+    }
+    REQUIRE_FALSE(snapshot.contains("nonesuch"));
+    REQUIRE(snapshot.find("nonesuch") == snapshot.end());
+    REQUIRE(snapshot["nonesuch"].empty());
+
+#if !defined(WIN32) // windows keys sort case insensitively
+    SECTION("is sorted by key")
+    {
+        auto keys = snapshot | ranges::views::transform(red::session::detail::keyval_fn(true)) | ranges::to_vector;
+        REQUIRE(ranges::is_sorted(keys));
+    }
+#endif
+    SECTION("doesn't see later changes")
+    {
+        environment["SERVER"] = "localhost";
+        environment.erase("PROTOCOL");
+
+        REQUIRE(snapshot["SERVER"] == "127.0.0.1");
+        REQUIRE(snapshot.contains("PROTOCOL"));
+    }
+    SECTION("saved and mapped")
+    {
+        auto const path = std::filesystem::temp_directory_path() / "red-sessions-test.snapshot";
+        snapshot.save(path);
+        environment["SERVER"] = "localhost";
+
+        {
+            auto const loaded = red::session::environment::snapshot::load(path);
+            REQUIRE(loaded->size() == snapshot.size());
+            REQUIRE(ranges::equal(*loaded, snapshot));
+            for(auto[key, value] : TEST_VARS)
+                REQUIRE((*loaded)[key] == value);
+            REQUIRE_FALSE(loaded->contains("nonesuch"));
+            REQUIRE(loaded->generation() == 0);
+
+            // saving again replaces the file, the mapping keeps the old one
+            environment["SNAPSHOTEXTRA"] = "extra";
+            red::session::environment::snapshot const bigger;
+            environment.erase("SNAPSHOTEXTRA");
+            bigger.save(path);
+            REQUIRE(ranges::equal(*loaded, snapshot));
+            REQUIRE(red::session::environment::snapshot::load(path)->size() == bigger.size());
+            snapshot.save(path);
+        }
+
+        // tables pointing past the strings
+        {
+            std::vector<char> bytes;
+            {
+                std::ifstream in{path, std::ios::binary};
+                bytes.assign(std::istreambuf_iterator<char>(in), {});
+            }
+            auto const header = reinterpret_cast<red::session::detail::snapshot_header const*>(bytes.data());
+            auto const entries = reinterpret_cast<red::session::detail::snapshot_entry*>(bytes.data() + sizeof *header);
+            auto const slots = reinterpret_cast<red::session::detail::snapshot_slot*>(entries + header->count);
+
+            auto const write = [&] {
+                std::ofstream out{path, std::ios::binary | std::ios::trunc};
+                out.write(bytes.data(), bytes.size());
+            };
+
+            auto const offset = entries[0].offset;
+            entries[0].offset = static_cast<std::uint32_t>(header->strings_size);
+            write();
+            REQUIRE_THROWS_AS(red::session::environment::snapshot::load(path), std::system_error);
+            entries[0].offset = offset;
+
+            slots[0].entry = header->count + 1;
+            write();
+            REQUIRE_THROWS_AS(red::session::environment::snapshot::load(path), std::system_error);
+        }
+
+        // a full index, lookups of missing keys would never find an empty slot
+        {
+            red::session::detail::snapshot_header header;
+            {
+                std::ifstream in{path, std::ios::binary};
+                in.read(reinterpret_cast<char*>(&header), sizeof header);
+            }
+            header.count = header.slots = 1;
+            header.strings_size = 4;
+            red::session::detail::snapshot_entry const entry{0, 1, 3};
+            red::session::detail::snapshot_slot const slot{0, 1};
+
+            std::ofstream out{path, std::ios::binary | std::ios::trunc};
+            out.write(reinterpret_cast<char const*>(&header), sizeof header);
+            out.write(reinterpret_cast<char const*>(&entry), sizeof entry);
+            out.write(reinterpret_cast<char const*>(&slot), sizeof slot);
+            out.write("A=1", 4);
+        }
+        REQUIRE_THROWS_AS(red::session::environment::snapshot::load(path), std::system_error);
+
+        // anything else is refused
+        {
+            std::ofstream out{path, std::ios::binary | std::ios::trunc};
+            out << "KEY=value";
+        }
+        REQUIRE_THROWS_AS(red::session::environment::snapshot::load(path), std::system_error);
+        std::filesystem::remove(path);
+        REQUIRE_THROWS_AS(red::session::environment::snapshot::load(path), std::system_error);
+    }
 }
 
 TEST_CASE("environment::variable", "[var]")
@@ -193,6 +795,263 @@ TEST_CASE("environment::variable", "[var]")
             REQUIRE(ranges::find(p, environment.path_separator) == p.end());
         }
     }
+    SECTION("Lazy split")
+    {
+        auto var = environment["mysplitvar"] = "a::b:c";
+        auto split = var.split(':');
+        auto const expected = std::vector<string_view>{"a", "", "b", "c"};
+
+        REQUIRE((split | ranges::to_vector) == expected);
+        REQUIRE(ranges::distance(split | ranges::views::take(2)) == 2);
+        REQUIRE(*ranges::find(split, "b"sv) == "b");
+
+        var = "trailing:";
+        REQUIRE((var.split(':') | ranges::to_vector) == std::vector<string_view>{"trailing", ""});
+
+        environment.erase("mysplitvar");
+        REQUIRE(var.split(':').begin() == var.split(':').end());
+    }
+}
+
+TEST_CASE("key matching", "[env]")
+{
+    using red::session::detail::basic_key_matcher;
+    auto const match_entry = [](char const* entry, string_view key, bool ignore_case) {
+        return basic_key_matcher<char>(key, ignore_case)(entry);
+    };
+
+    REQUIRE(match_entry("KEY=value", "KEY", false));
+    REQUIRE(match_entry("KEY=", "KEY", false));
+    REQUIRE_FALSE(match_entry("KEYS=value", "KEY", false));
+    REQUIRE_FALSE(match_entry("KE=value", "KEY", false));
+    REQUIRE_FALSE(match_entry("KEY", "KEY", false));
+    REQUIRE_FALSE(match_entry("", "KEY", false));
+
+    SECTION("ignoring case")
+    {
+        REQUIRE_FALSE(match_entry("path=/bin", "PATH", false));
+        REQUIRE(match_entry("path=/bin", "PATH", true));
+        REQUIRE(match_entry("PaTh=/bin", "pAtH", true));
+        // only letters fold
+        REQUIRE_FALSE(match_entry("@[=1", "`{", true));
+        REQUIRE_FALSE(match_entry("\xC0=1", "\xE0", true));
+    }
+    SECTION("long keys")
+    {
+        for (std::size_t length : {15, 16, 31, 32, 33, 127, 128, 300})
+        {
+            auto const key = string(length, 'K') + "x";
+            auto const entry = key + "=value";
+            CAPTURE(length);
+            REQUIRE(match_entry(entry.c_str(), key, false));
+            REQUIRE_FALSE(match_entry(entry.c_str(), string(length, 'K') + "y", false));
+            REQUIRE_FALSE(match_entry(key.c_str(), key, false));
+        }
+    }
+    SECTION("finding entries")
+    {
+        std::array<char const*, 4> block{"A=1", "lower=2", "B=3", nullptr};
+        auto const find_entry = [&](string_view key, bool ignore_case) {
+            basic_key_matcher<char> const matches(key, ignore_case);
+            return std::find_if(block.begin(), block.end() - 1, std::cref(matches)) - block.begin();
+        };
+        REQUIRE(find_entry("B", false) == 2);
+        REQUIRE(find_entry("LOWER", true) == 1);
+        REQUIRE(find_entry("LOWER", false) == 3);
+    }
+#if defined(__unix__)
+    SECTION("entries at the end of a page")
+    {
+        // the page after the entry can't be read, loads must not cross into it
+        auto const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        auto* pages = static_cast<char*>(mmap(nullptr, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        REQUIRE(pages != MAP_FAILED);
+        REQUIRE(mprotect(pages + page, page, PROT_NONE) == 0);
+
+        for (std::size_t size : {2, 5, 17, 40})
+        {
+            auto const line = string(size - 2, 'K') + "=";
+            auto* entry = pages + page - line.size() - 1;
+            std::memcpy(entry, line.c_str(), line.size() + 1);
+
+            CAPTURE(size);
+            REQUIRE(match_entry(entry, string_view(line).substr(0, size - 2), false));
+            REQUIRE_FALSE(match_entry(entry, string(size + 40, 'K'), true));
+        }
+        munmap(pages, page * 2);
+    }
+#endif
+}
+
+TEST_CASE("get many variables at once", "[env]")
+{
+    test_vars_guard _;
+
+    auto values = environment.get_many("SERVER", "nonesuch"s, "DRUAGA1"sv, "SERVER");
+    REQUIRE(values.size() == 4);
+    REQUIRE(values[0] == "127.0.0.1");
+    REQUIRE_FALSE(values[1]);
+    REQUIRE(values[2] == "WEED");
+    REQUIRE(values[3] == "127.0.0.1");
+
+    auto const keys = std::vector<string>{"thug2song", "PROTOCOL", "Phasellus", "nope"};
+    values = environment.get_many(keys);
+    REQUIRE(values.size() == 4);
+    REQUIRE(values[0] == "354125go");
+    REQUIRE(values[1] == "DEFAULT");
+    REQUIRE(values[2] == "LoremIpsumDolor");
+    REQUIRE_FALSE(values[3]);
+
+    SECTION("empty values are found")
+    {
+        environment["EMPTYVAR"] = "";
+#if defined(WIN32) // setting an empty value erases it
+        REQUIRE_FALSE(environment.get_many("EMPTYVAR")[0]);
+#else
+        REQUIRE(environment.get_many("EMPTYVAR")[0] == ""sv);
+#endif
+        environment.erase("EMPTYVAR");
+    }
+    SECTION("overlays are seen")
+    {
+        red::session::environment::overlay overlay;
+        overlay.set("SERVER", "localhost").erase("DRUAGA1");
+        values = environment.get_many("SERVER", "DRUAGA1");
+        REQUIRE(values[0] == "localhost");
+        REQUIRE_FALSE(values[1]);
+    }
+    SECTION("no keys")
+    {
+        REQUIRE(environment.get_many(std::vector<string>{}).empty());
+    }
+}
+
+TEST_CASE("long keys", "[var]")
+{
+    // past the inline buffer of variable
+    auto const key = "LONGKEY_" + string(200, 'x');
+    auto var = environment[key];
+    REQUIRE(var.key() == key);
+
+    var = "long";
+    auto copy = var;
+    REQUIRE(copy.key() == key);
+    REQUIRE(copy.value() == "long");
+    REQUIRE(sys::getenv(key) == "long");
+
+    environment.erase(key);
+    REQUIRE_FALSE(environment.contains(key));
+}
+
+TEST_CASE("values into caller memory", "[var]")
+{
+    environment["BUFFERVAR"] = "one;two;three";
+    auto var = environment["BUFFERVAR"];
+
+    SECTION("value_into")
+    {
+        string out;
+        out.reserve(64);
+        auto const capacity = out.capacity();
+        REQUIRE(var.value_into(out));
+        REQUIRE(out == "one;two;three");
+        REQUIRE(out.capacity() == capacity);
+
+        REQUIRE_FALSE(environment["NOTBUFFERVAR"].value_into(out));
+        REQUIRE(out.empty());
+    }
+    SECTION("memory resources")
+    {
+        // nothing may come from the heap
+        std::array<std::byte, 4096> storage;
+        std::pmr::monotonic_buffer_resource pool{storage.data(), storage.size(), std::pmr::null_memory_resource()};
+
+        auto value = var.value(&pool);
+        REQUIRE(value == "one;two;three");
+        REQUIRE(value.get_allocator().resource() == &pool);
+
+        auto pieces = var.split(';', &pool);
+        REQUIRE(ranges::distance(pieces) == 3);
+        REQUIRE(*pieces.begin() == "one");
+
+        // every key is copied, the host's environment can be of any size
+        std::pmr::monotonic_buffer_resource keys_pool;
+        std::pmr::vector<std::pmr::string> keys{&keys_pool};
+        for (auto&& key : environment.keys(&keys_pool)) {
+            if (key == "BUFFERVAR")
+                keys.push_back(std::move(key));
+        }
+        REQUIRE(keys.size() == 1);
+        REQUIRE(keys[0].get_allocator().resource() == &keys_pool);
+    }
+
+    environment.erase("BUFFERVAR");
+}
+
+TEST_CASE("typed variable values", "[var]")
+{
+    using namespace std::chrono_literals;
+    enum class level { quiet, normal, loud };
+
+    environment["TYPEDVAR"] = "42";
+    auto var = environment["TYPEDVAR"];
+
+    REQUIRE(var.as<int>() == 42);
+    REQUIRE(var.try_as<unsigned char>() == 42);
+    REQUIRE(var.as<double>() == 42.0);
+    REQUIRE(var.as<std::chrono::seconds>() == 42s);
+    REQUIRE(var.as<std::string>() == "42");
+
+    var = "2";
+    REQUIRE(var.as<level>() == level::loud);
+    var = "250ms";
+    REQUIRE(var.as<std::chrono::milliseconds>() == 250ms);
+    REQUIRE(var.as<std::chrono::seconds>() == 0s);
+    var = "1.5h";
+    REQUIRE(var.as<std::chrono::duration<double>>() == 5400s);
+    var = "Yes";
+    REQUIRE(var.as<bool>());
+    var = "off";
+    REQUIRE_FALSE(var.as<bool>());
+
+    SECTION("bad values")
+    {
+        var = "12abc";
+        REQUIRE_FALSE(var.try_as<int>());
+        REQUIRE_THROWS_AS(var.as<int>(), std::invalid_argument);
+        var = "300";
+        REQUIRE_FALSE(var.try_as<std::int8_t>());
+        var = "5 parsecs";
+        REQUIRE_FALSE(var.try_as<std::chrono::seconds>());
+    }
+    SECTION("missing variables")
+    {
+        environment.erase("TYPEDVAR");
+        REQUIRE_FALSE(var.try_as<std::string>());
+        REQUIRE_THROWS_AS(var.as<int>(), std::invalid_argument);
+    }
+    SECTION("cached values")
+    {
+        red::session::environment::cached<int> cached("TYPEDVAR");
+        var = "7";
+        REQUIRE(cached.get() == 7);
+        REQUIRE(cached.get() == 7);
+
+        var = "8";
+        REQUIRE(cached.get() == 8);
+
+        {
+            red::session::environment::overlay overlay;
+            overlay.set("TYPEDVAR", "9");
+            REQUIRE(cached.get() == 9);
+        }
+        REQUIRE(cached.get() == 8);
+
+        environment.erase("TYPEDVAR");
+        REQUIRE(cached.get(-1) == -1);
+    }
+
+    environment.erase("TYPEDVAR");
 }
 
 TEST_CASE("use environment like a range", "[env][range]")
@@ -211,6 +1070,256 @@ TEST_CASE("use environment like a range", "[env][range]")
     REQUIRE(ranges::distance(environment.begin(), range_it) == ranges::distance(environment.begin(), env_it));
 }
 
+TEST_CASE("concurrent readers and a writer", "[mt]")
+{
+    using snapshot = red::session::environment::snapshot;
+    auto const is_number = [](string_view v) {
+        return !v.empty() && v.find_first_not_of("0123456789") == string_view::npos;
+    };
+
+    environment["MTVAR"] = "0";
+    std::atomic<bool> done = false;
+    std::atomic<int> failures = 0;
+
+    auto reader = [&] {
+        while (!done)
+        {
+            if (!is_number(environment["MTVAR"].value()))
+                failures++;
+            if (!environment.contains("MTVAR"))
+                failures++;
+
+            auto snap = snapshot::current();
+            if (!is_number((*snap)["MTVAR"]))
+                failures++;
+            if (environment.empty())
+                failures++;
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++)
+        readers.emplace_back(reader);
+
+    // keep the block moving by adding and removing variables
+    for (int i = 0; i < 500; i++)
+    {
+        auto const n = std::to_string(i);
+        environment["MTVAR"] = n;
+        environment["MTVAR_" + std::to_string(i % 64)] = n;
+        if (i % 3 == 0)
+            environment.erase("MTVAR_" + std::to_string((i / 3) % 64));
+    }
+
+    done = true;
+    for (auto& t : readers)
+        t.join();
+
+    REQUIRE(failures == 0);
+    REQUIRE((*snapshot::current())["MTVAR"] == "499");
+
+    environment.erase("MTVAR");
+    for (int i = 0; i < 64; i++)
+        environment.erase("MTVAR_" + std::to_string(i));
+}
+
+TEST_CASE("spawn processes", "[spawn]")
+{
+    test_vars_guard _;
+#if defined(WIN32)
+    auto const args = std::array{"cmd"sv, "/c"sv, "exit %CHILDVAR%"sv};
+#else
+    auto const args = std::array{"sh"sv, "-c"sv, "exit $CHILDVAR"sv};
+#endif
+
+    SECTION("with a built environment")
+    {
+        red::session::environment::envp_builder env;
+        env.set("CHILDVAR", "7");
+
+        auto child = red::session::spawn(args, env);
+        REQUIRE(child.valid());
+        REQUIRE(child.wait() == 7);
+        REQUIRE_FALSE(environment.contains("CHILDVAR"));
+
+        // a child is waited for once
+        REQUIRE_FALSE(child.valid());
+        REQUIRE_THROWS_AS(child.wait(), std::system_error);
+    }
+    SECTION("invalid children")
+    {
+        red::session::child none;
+        REQUIRE_THROWS_AS(none.wait(), std::system_error);
+
+        red::session::environment::envp_builder env;
+        env.set("CHILDVAR", "1");
+        auto child = red::session::spawn(args, env);
+        auto moved = std::move(child);
+        REQUIRE_THROWS_AS(child.wait(), std::system_error);
+        REQUIRE(moved.wait() == 1);
+    }
+    SECTION("inheriting the environment")
+    {
+        environment["CHILDVAR"] = "3";
+        REQUIRE(red::session::spawn(args).wait() == 3);
+        environment.erase("CHILDVAR");
+    }
+    SECTION("inheriting an overlay")
+    {
+        red::session::environment::overlay overlay;
+        overlay.set("CHILDVAR", "5");
+        REQUIRE(red::session::spawn(args).wait() == 5);
+    }
+    SECTION("empty arguments throw")
+    {
+        REQUIRE_THROWS_AS(red::session::spawn(std::array<string_view, 0>{}), std::invalid_argument);
+    }
+#if defined(__unix__)
+    SECTION("dropped children are reaped")
+    {
+        pid_t pid;
+        {
+            auto const slow = std::array{"sh"sv, "-c"sv, "sleep 0.1"sv};
+            pid = red::session::spawn(slow).native_handle();
+        }
+        std::this_thread::sleep_for(300ms);
+        red::session::spawn(std::array{"true"sv}).wait();
+
+        // it's not our child anymore
+        REQUIRE(waitpid(pid, nullptr, WNOHANG) == -1);
+        REQUIRE(errno == ECHILD);
+    }
+#endif
+    SECTION("missing programs throw")
+    {
+        auto const missing = std::array{"red-sessions-no-such-program"sv};
+        REQUIRE_THROWS_AS(red::session::spawn(missing).wait(), std::system_error);
+    }
+}
+
+TEST_CASE("command line options", "[opts]")
+{
+    auto const args = std::array{
+        "prog"sv, "--threads=8"sv, "--name"sv, "red"sv, "-vvx"sv, "file.tar"sv, "input"sv,
+        "--ratio"sv, "0.5"sv, "--dry-run"sv, "-I"sv, "a"sv, "-I"sv, "b"sv, "--"sv, "--not-an-option"sv, "-q"sv
+    };
+    red::session::options opts(args, {"--name", "--ratio", "-x", "-I"});
+
+    REQUIRE(opts.program() == "prog");
+    REQUIRE(opts.has("--threads"));
+    REQUIRE(opts.get<int>("--threads") == 8);
+    REQUIRE(opts.value("--name") == "red");
+    REQUIRE(opts.get<double>("--ratio") == 0.5);
+    REQUIRE(opts.get<bool>("--dry-run") == true);
+    REQUIRE_FALSE(opts.value("--dry-run"));
+
+    SECTION("short options")
+    {
+        REQUIRE(opts.count("-v") == 2);
+        REQUIRE(opts.value("-x") == "file.tar");
+        REQUIRE_FALSE(opts.value("-v"));
+        REQUIRE(opts.value("-I") == "b");
+        REQUIRE(opts.count("-I") == 2);
+        // short and long names don't mix
+        REQUIRE_FALSE(opts.has("--v"));
+        REQUIRE_FALSE(opts.has("-n"));
+    }
+    SECTION("positional arguments")
+    {
+        auto const expected = std::vector{"input"sv, "--not-an-option"sv, "-q"sv};
+        REQUIRE(opts.positional() == expected);
+        REQUIRE_FALSE(opts.has("--not-an-option"));
+        REQUIRE_FALSE(opts.has("-q"));
+    }
+    SECTION("missing and malformed values")
+    {
+        REQUIRE_FALSE(opts.has("--missing"));
+        REQUIRE_FALSE(opts.get<int>("--missing"));
+        REQUIRE(opts.get<int>("--missing", 4) == 4);
+        REQUIRE_FALSE(opts.get<int>("--name"));
+        REQUIRE_FALSE(opts.get<int>("--dry-run"));
+    }
+    SECTION("flags don't take values")
+    {
+        auto const flags = std::array{"prog"sv, "--verbose"sv, "input.txt"sv, "-v"sv, "more.txt"sv};
+        red::session::options parsed(flags);
+        REQUIRE(parsed.get<bool>("--verbose") == true);
+        REQUIRE(parsed.get<bool>("-v") == true);
+        REQUIRE(parsed.positional() == std::vector{"input.txt"sv, "more.txt"sv});
+    }
+    SECTION("negative numbers")
+    {
+        auto const numbers = std::array{"prog"sv, "--threads"sv, "-1"sv, "-5"sv, "-ofile"sv, "-n"sv, "-2"sv};
+        red::session::options parsed(numbers, {"--threads", "-o", "-n"});
+        REQUIRE(parsed.get<int>("--threads") == -1);
+        REQUIRE(parsed.get<int>("-n") == -2);
+        REQUIRE(parsed.value("-o") == "file");
+        REQUIRE(parsed.positional() == std::vector{"-5"sv});
+        REQUIRE_FALSE(parsed.has("-1"));
+        REQUIRE_FALSE(parsed.has("-f"));
+    }
+}
+
+TEST_CASE("compile time key tables", "[env][opts]")
+{
+    using env_keys = red::session::key_table<"SERVER", "PROTOCOL", "nonesuch", "thug2song">;
+    static_assert(env_keys::index_of<"PROTOCOL">() == 1);
+    static_assert(env_keys::find("thug2song") == 3);
+    static_assert(env_keys::find("SERVERS") == env_keys::npos);
+
+    // enough keys to need displacements
+    using big = red::session::key_table<
+        "HOME", "PATH", "USER", "SHELL", "LANG", "TERM", "PWD", "EDITOR", "PAGER", "TMPDIR",
+        "LOG_LEVEL", "LOG_FILE", "THREADS", "CACHE_DIR", "CONFIG", "DEBUG", "PROFILE", "REGION",
+        "TIMEOUT", "RETRIES", "PROXY", "NO_PROXY", "TZ", "LC_ALL", "DISPLAY", "HOSTNAME", "MAIL",
+        "XDG_DATA_HOME", "XDG_CONFIG_HOME", "XDG_CACHE_HOME", "XDG_RUNTIME_DIR", "SSH_AUTH_SOCK", "OLDPWD">;
+    static_assert([] {
+        for (std::size_t i = 0; i < big::size; i++) {
+            if (big::find(big::keys[i]) != i)
+                return false;
+        }
+        return big::find("PATHS") == big::npos && big::find("path") == big::npos;
+    }());
+
+    SECTION("environment")
+    {
+        test_vars_guard _;
+        auto const values = env_keys::resolve();
+
+        REQUIRE(values.get<"SERVER">() == "127.0.0.1");
+        REQUIRE(values[env_keys::index_of<"thug2song">()] == "354125go");
+        REQUIRE(values.contains<"PROTOCOL">());
+        REQUIRE_FALSE(values.get<"nonesuch">());
+    }
+#if defined(__unix__)
+    SECTION("odd entries")
+    {
+        char const* block[] = {"NOEQ", "DUP=first", "DUP=second", nullptr};
+        auto const saved = environ;
+        environ = const_cast<char**>(block);
+        environment.touch();
+        auto const snap = std::make_shared<const red::session::environment::snapshot>();
+        environ = saved;
+        environment.touch();
+
+        auto const values = red::session::key_table<"NOEQ", "DUP">::resolve(snap);
+        REQUIRE_FALSE(values.contains<"NOEQ">());
+        REQUIRE(values.get<"DUP">() == (*snap)["DUP"]);
+        REQUIRE(values.get<"DUP">() == "first");
+    }
+#endif
+    SECTION("options")
+    {
+        auto const args = std::array{"prog"sv, "--threads=4"sv, "-v"sv};
+        red::session::options opts(args);
+        auto const values = red::session::key_table<"--threads", "-v", "--name">::resolve(opts);
+
+        REQUIRE(values.get<"--threads">() == "4");
+        REQUIRE(values.get<"-v">() == "");
+        REQUIRE_FALSE(values.contains<"--name">());
+    }
+}
+
 TEST_CASE("join_paths")
 {
     using red::session::join_paths;
@@ -259,6 +1368,36 @@ TEST_CASE("Arguments", "[args]")
     {
         REQUIRE(arguments[i] == cmdargs[i]);
     }
+
+    red::session::options opts;
+    REQUIRE(opts.program() == cmdargs[0]);
+}
+
+TEST_CASE("Arguments from many threads", "[args][mt]")
+{
+    std::atomic<bool> go = false;
+    std::atomic<int> failures = 0;
+
+    auto reader = [&] {
+        while (!go)
+            std::this_thread::yield();
+
+        red::session::arguments arguments;
+        if (arguments.size() != cmdargs.size())
+            failures++;
+        else if (!ranges::equal(arguments, cmdargs))
+            failures++;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++)
+        threads.emplace_back(reader);
+
+    go = true;
+    for (auto& t : threads)
+        t.join();
+
+    REQUIRE(failures == 0);
 }
 
 